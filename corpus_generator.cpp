@@ -0,0 +1,309 @@
+#include <iostream> // Standard library for input and output streams.
+#include <fstream> // Library for file stream operations.
+#include <string> // Library for strings.
+#include <vector> // Library for dynamic arrays.
+#include <cstdint> // Library for fixed-width integer types.
+#include <cmath> // Library for pow.
+#include <algorithm> // Library for sorting and searching algorithms.
+#include <stdexcept> // Library for standard exception types.
+#include <cstdio> // Library for snprintf.
+#include <cctype> // Library for toupper.
+
+using namespace std; // Using the standard namespace.
+
+/// @struct SplitMix64
+/// @brief Small pseudo-random generator with a fixed, platform independent sequence.
+///
+/// The standard distributions are implementation defined, so all sampling below is done
+/// on top of the raw 64-bit outputs to keep corpora identical across compilers and machines.
+struct SplitMix64
+{
+    uint64_t state; ///< Current state.
+
+    explicit SplitMix64(uint64_t seed) : state(seed) {}
+
+    /// @brief Returns the next 64 random bits.
+    uint64_t Next()
+    {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    /// @brief Returns a value in [0, bound).
+    uint64_t Below(uint64_t bound)
+    {
+        return static_cast<uint64_t>((static_cast<unsigned __int128>(Next()) * bound) >> 64);
+    }
+
+    /// @brief Returns a value in [0, 1).
+    double Uniform()
+    {
+        return (Next() >> 11) * 0x1.0p-53;
+    }
+};
+
+/// @struct ZipfSampler
+/// @brief Samples ranks 0..n-1 with probability proportional to 1 / (rank + 1)^exponent.
+struct ZipfSampler
+{
+    vector<double> cumulative; ///< Cumulative probabilities, the last one is 1.
+
+    ZipfSampler(size_t n, double exponent)
+    {
+        double total = 0;
+        for (size_t rank = 0; rank < n; rank++)
+            cumulative.push_back(total += 1.0 / pow(double(rank + 1), exponent));
+        for (double& value : cumulative)
+            value /= total;
+    }
+
+    /// @brief Draws one rank.
+    size_t Sample(SplitMix64& random) const
+    {
+        size_t rank = upper_bound(cumulative.begin(), cumulative.end(), random.Uniform()) - cumulative.begin();
+        return min(rank, cumulative.size() - 1);
+    }
+};
+
+/// @struct CorpusWriter
+/// @brief Buffers generated bytes and stops the generator once the requested size is reached.
+struct CorpusWriter
+{
+    ofstream& output; ///< Destination file.
+    uint64_t remaining; ///< Bytes still to produce.
+    string buffer; ///< Pending bytes.
+
+    CorpusWriter(ofstream& output, uint64_t size) : output(output), remaining(size) {}
+
+    /// @brief Whether more bytes are wanted.
+    bool Wants() const
+    {
+        return remaining > 0;
+    }
+
+    /// @brief Appends bytes, truncating at the requested size.
+    void Append(const char* data, size_t size)
+    {
+        size = static_cast<size_t>(min<uint64_t>(size, remaining));
+        buffer.append(data, size);
+        remaining -= size;
+        if (buffer.size() >= (1 << 20) || remaining == 0)
+        {
+            output.write(buffer.data(), buffer.size()); ///< Writes in 1 MiB chunks, so any size fits in memory.
+            buffer.clear();
+        }
+    }
+
+    void Append(const string& text) { Append(text.data(), text.size()); }
+    void Append(char ch) { Append(&ch, 1); }
+};
+
+/// @brief Uniformly distributed bytes over all 256 values (incompressible).
+void GenerateUniform(CorpusWriter& writer, SplitMix64& random)
+{
+    while (writer.Wants())
+    {
+        uint64_t bits = random.Next();
+        char bytes[8];
+        for (int i = 0; i < 8; i++)
+            bytes[i] = static_cast<char>(bits >> (8 * i)); ///< Little-endian regardless of the host.
+        writer.Append(bytes, sizeof(bytes));
+    }
+}
+
+/// @brief Bytes whose frequency follows a Zipf law over all 256 values, rank r is byte r.
+void GenerateZipf(CorpusWriter& writer, SplitMix64& random, double exponent)
+{
+    ZipfSampler sampler(256, exponent);
+    while (writer.Wants())
+        writer.Append(static_cast<char>(sampler.Sample(random)));
+}
+
+/// @brief Runs of a single random byte, with run lengths uniform in [1, 256].
+void GenerateRuns(CorpusWriter& writer, SplitMix64& random)
+{
+    while (writer.Wants())
+    {
+        string run(1 + random.Below(256), static_cast<char>(random.Below(256)));
+        writer.Append(run);
+    }
+}
+
+/// @brief English-like text: Zipf distributed common words, sentences and wrapped lines.
+void GenerateEnglish(CorpusWriter& writer, SplitMix64& random, double exponent)
+{
+    static const vector<string> words = {
+        "the", "of", "and", "to", "a", "in", "is", "it", "you", "that", "he", "was", "for", "on", "are", "with",
+        "as", "his", "they", "be", "at", "one", "have", "this", "from", "or", "had", "by", "not", "word", "but",
+        "what", "some", "we", "can", "out", "other", "were", "all", "there", "when", "up", "use", "your", "how",
+        "said", "an", "each", "she", "which", "do", "their", "time", "if", "will", "way", "about", "many", "then",
+        "them", "write", "would", "like", "so", "these", "her", "long", "make", "thing", "see", "him", "two",
+        "has", "look", "more", "day", "could", "go", "come", "did", "number", "sound", "no", "most", "people",
+        "my", "over", "know", "water", "than", "call", "first", "who", "may", "down", "side", "been", "now",
+        "find", "compression", "algorithm", "corpus", "results", "files", "canterbury", "frequency", "tree"
+    };
+    ZipfSampler sampler(words.size(), exponent);
+    size_t lineLength = 0, sentenceLength = 0;
+    while (writer.Wants())
+    {
+        string word = words[sampler.Sample(random)];
+        if (sentenceLength == 0)
+            word[0] = static_cast<char>(toupper(word[0]));
+        sentenceLength++;
+        if (sentenceLength > 4 && random.Below(10) == 0)
+        {
+            word += (random.Below(4) == 0 ? "," : ".");
+            if (word.back() == '.')
+                sentenceLength = 0;
+        }
+        if (lineLength + word.size() + 1 > 72)
+        {
+            writer.Append('\n');
+            lineLength = 0;
+        }
+        else if (lineLength > 0)
+        {
+            writer.Append(' ');
+            lineLength++;
+        }
+        writer.Append(word);
+        lineLength += word.size();
+    }
+}
+
+/// @brief Log-like lines: increasing timestamps, a few line templates and variable fields.
+void GenerateLogs(CorpusWriter& writer, SplitMix64& random)
+{
+    static const char* levels[] = { "INFO", "INFO", "INFO", "INFO", "DEBUG", "DEBUG", "WARN", "ERROR" };
+    static const char* paths[] = { "/api/v1/items", "/api/v1/users", "/api/v2/orders", "/healthz", "/static/app.js" };
+    static const int statuses[] = { 200, 200, 200, 200, 201, 204, 304, 404, 500 };
+    uint64_t milliseconds = 1700000000000ull;
+    char line[256];
+    while (writer.Wants())
+    {
+        milliseconds += random.Below(50);
+        uint64_t seconds = milliseconds / 1000;
+        int hours = static_cast<int>(seconds / 3600 % 24), minutes = static_cast<int>(seconds / 60 % 60), secs = static_cast<int>(seconds % 60);
+        int length = snprintf(line, sizeof(line), "2026-10-18T%02d:%02d:%02d.%03dZ %s [worker-%d] ",
+            hours, minutes, secs, static_cast<int>(milliseconds % 1000), levels[random.Below(8)], static_cast<int>(random.Below(16)));
+        writer.Append(line, length);
+        switch (random.Below(4))
+        {
+        case 0:
+        case 1:
+            length = snprintf(line, sizeof(line), "request id=%016llx method=GET path=%s/%d status=%d latency_ms=%d\n",
+                static_cast<unsigned long long>(random.Next()), paths[random.Below(5)], static_cast<int>(random.Below(100000)),
+                statuses[random.Below(9)], static_cast<int>(random.Below(2000)));
+            break;
+        case 2:
+            length = snprintf(line, sizeof(line), "cache %s key=user:%d size=%d\n",
+                random.Below(3) == 0 ? "miss" : "hit", static_cast<int>(random.Below(1000000)), static_cast<int>(random.Below(65536)));
+            break;
+        default:
+            length = snprintf(line, sizeof(line), "connection from 10.%d.%d.%d:%d closed after %d ms\n",
+                static_cast<int>(random.Below(256)), static_cast<int>(random.Below(256)), static_cast<int>(random.Below(256)),
+                static_cast<int>(1024 + random.Below(64000)), static_cast<int>(random.Below(100000)));
+        }
+        writer.Append(line, length);
+    }
+}
+
+/// @brief Symbols with Fibonacci frequencies, which give the deepest possible Huffman tree.
+///
+/// The output is a sequence of shuffled chunks of at most 16 MiB, each containing symbol i exactly
+/// Fib(i) times, so every chunk (and thus any block of a few MiB) has the pathological histogram.
+void GenerateFibonacci(CorpusWriter& writer, SplitMix64& random)
+{
+    vector<uint64_t> fibonacci = { 1, 1 };
+    uint64_t chunkSize = 2;
+    uint64_t limit = min<uint64_t>(writer.remaining, 16 << 20);
+    while (chunkSize + fibonacci[fibonacci.size() - 1] + fibonacci[fibonacci.size() - 2] <= limit && fibonacci.size() < 90)
+    {
+        fibonacci.push_back(fibonacci[fibonacci.size() - 1] + fibonacci[fibonacci.size() - 2]);
+        chunkSize += fibonacci.back();
+    }
+
+    string chunk;
+    for (size_t symbol = 0; symbol < fibonacci.size(); symbol++)
+        chunk.append(fibonacci[symbol], static_cast<char>('!' + symbol));
+    while (writer.Wants())
+    {
+        for (size_t i = chunk.size(); i > 1; i--)
+            swap(chunk[i - 1], chunk[random.Below(i)]); ///< Fisher-Yates shuffle on the portable generator.
+        writer.Append(chunk);
+    }
+}
+
+/// @brief Parses a size such as 4096, 64K, 16M or 20G (binary multiples).
+uint64_t ParseSize(const string& text)
+{
+    size_t digits = 0;
+    uint64_t value = stoull(text, &digits);
+    string suffix = text.substr(digits);
+    if (suffix.empty() || suffix == "B")
+        return value;
+    if (suffix == "K" || suffix == "KiB")
+        return value << 10;
+    if (suffix == "M" || suffix == "MiB")
+        return value << 20;
+    if (suffix == "G" || suffix == "GiB")
+        return value << 30;
+    throw runtime_error("Unknown size suffix " + suffix);
+}
+
+/// @brief Generates a synthetic benchmark corpus.
+/// @param argc Number of command line arguments.
+/// @param argv Array of command line arguments.
+/// @returns Returns 0 on successful execution, or 1 on error.
+int main(int argc, char* argv[]) {
+    if (argc < 4) {
+        cerr << "Usage: " << argv[0] << " <distribution> <output file> <size> [--seed N] [--exponent S]" << endl;
+        cerr << "Distributions: uniform, zipf, runs, english, logs, fibonacci" << endl;
+        cerr << "Sizes accept K, M and G suffixes (binary multiples)." << endl;
+        return 1;
+    }
+
+    string distribution = argv[1];
+    string outputFileName = argv[2];
+    try {
+        uint64_t size = ParseSize(argv[3]);
+        uint64_t seed = 42; ///< Fixed default, so corpora are reproducible unless a seed is given.
+        double exponent = 1.0; ///< Zipf exponent for the zipf and english distributions.
+        for (int i = 4; i + 1 < argc; i += 2) {
+            string option = argv[i];
+            if (option == "--seed")
+                seed = stoull(argv[i + 1]);
+            else if (option == "--exponent")
+                exponent = stod(argv[i + 1]);
+            else
+                throw runtime_error("Unknown option " + option);
+        }
+
+        ofstream outputFile(outputFileName, ios::binary);
+        if (!outputFile)
+            throw runtime_error("Cannot open " + outputFileName);
+        CorpusWriter writer(outputFile, size);
+        SplitMix64 random(seed);
+        if (distribution == "uniform")
+            GenerateUniform(writer, random);
+        else if (distribution == "zipf")
+            GenerateZipf(writer, random, exponent);
+        else if (distribution == "runs")
+            GenerateRuns(writer, random);
+        else if (distribution == "english")
+            GenerateEnglish(writer, random, exponent);
+        else if (distribution == "logs")
+            GenerateLogs(writer, random);
+        else if (distribution == "fibonacci")
+            GenerateFibonacci(writer, random);
+        else
+            throw runtime_error("Unknown distribution " + distribution);
+    }
+    catch (const exception& error) {
+        cerr << "Error: " << error.what() << endl;
+        return 1;
+    }
+    return 0;
+}
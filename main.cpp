@@ -6,6 +6,26 @@
 #include <sstream> // Library for string stream operations.
 #include <bitset> // Library for bitset operations.
 #include <filesystem> // Library for file size operations.
+#include <vector> // Library for dynamic arrays.
+#include <cstdint> // Library for fixed-width integer types.
+#include <algorithm> // Library for sorting and searching algorithms.
+#include <stdexcept> // Library for standard exception types.
+#include <functional> // Library for function objects and searchers.
+#include <thread> // Library for worker threads.
+#include <atomic> // Library for atomic counters shared between threads.
+#include <mutex> // Library for mutual exclusion.
+#include <exception> // Library for passing exceptions between threads.
+#include <chrono> // Library for timing measurements.
+#include <iomanip> // Library for formatted table output.
+#include <cstdlib> // Library for malloc and free.
+#include <new> // Library for allocation functions.
+#include <memory_resource> // Library for caller supplied allocators.
+#include <memory> // Library for smart pointers.
+#include <cmath> // Library for logarithms.
+#include <string_view> // Library for views of tokens inside a buffer.
+#ifdef __SSE2__
+#include <emmintrin.h> // SSE2 intrinsics for the block filters.
+#endif
 
 using namespace std; // Using the standard namespace.
 namespace fs = std::filesystem; // Use a namespace alias for simplicity.
@@ -18,13 +38,19 @@ namespace fs = std::filesystem; // Use a namespace alias for simplicity.
 struct TreeNode
 {
     char character; ///< Character data of the node.
+    unsigned symbol; ///< Symbol index of the node, allows alphabets wider than a byte (the escape, pairs, dictionary tokens, wide symbols).
     unsigned frequency; ///< Frequency of the character.
     TreeNode* left, * right; ///< Pointers to the left and right child nodes.
 
     // Constructor
     TreeNode(char character, unsigned frequency)
-        : character(character), frequency(frequency), left(nullptr), right(nullptr)
+        : character(character), symbol(static_cast<unsigned char>(character)), frequency(frequency), left(nullptr), right(nullptr)
     {} ///< Initializes a new node with given character and frequency, left and right pointers are set to nullptr.
+
+    // Constructor
+    TreeNode(unsigned symbol, unsigned frequency)
+        : character(static_cast<char>(symbol)), symbol(symbol), frequency(frequency), left(nullptr), right(nullptr)
+    {} ///< Initializes a new node with given symbol index and frequency.
 };
 
 /// @struct CompareNodes
@@ -36,7 +62,9 @@ struct CompareNodes
 {
     bool operator()(TreeNode* left, TreeNode* right)
     {
-        return (left->frequency > right->frequency); ///< Defines comparison operation for two TreeNode pointers, used in priority queue.
+        if (left->frequency != right->frequency)
+            return (left->frequency > right->frequency); ///< Defines comparison operation for two TreeNode pointers, used in priority queue.
+        return (left->symbol > right->symbol); ///< Breaks ties by symbol, so the tree shape does not depend on the heap implementation.
     }
 };
 
@@ -119,7 +147,7 @@ void BuildHuffmanTree(string inputText, const string& outputFileName, priority_q
 /// @param fileName The name of the file to read.
 /// @returns The contents of the file as a string.
 string ReadFile(const string& fileName) {
-    ifstream file(fileName);
+    ifstream file(fileName, ios::binary);
     stringstream buffer;
     buffer << file.rdbuf(); ///< Reads the entire contents of the file into a string buffer.
     file.close(); ///< Closes the file stream.
@@ -161,18 +189,18 @@ void DecodeBinaryFile(const string& encodedFileName, ofstream& outputFile, const
     Decode(encodedString, outputFile, huffmanCodes); ///< Decodes the encoded string and writes it to the output file.
 }
 
-/// @brief Decodes a file encoded with Huffman coding.
-/// @param encodedFileName The name of the file containing encoded data.
+/// @brief Reads a Huffman code file written by BuildHuffmanTree.
 /// @param huffFileName The name of the file containing Huffman codes.
-/// @param outputFileName The name of the file to write the decoded data.
-void DecodeFile(const string& encodedFileName, const string& huffFileName, const string& outputFileName) {
+/// @returns The map of Huffman codes to their corresponding characters.
+unordered_map<string, char> ReadHuffmanCodeFile(const string& huffFileName) {
     ifstream codeFile(huffFileName);
     string line;
     unordered_map<string, char> huffmanCodes;
     while (getline(codeFile, line)) {
         if (!line.empty()) {
-            string symbol = line.substr(0, line.find(':')); ///< Extracts the character symbol from the line.
-            string code = line.substr(line.find(':') + 1); ///< Extracts the Huffman code from the line.
+            size_t separator = line.find(':', 1); ///< Searches from the second character, so ':' itself can be a symbol.
+            string symbol = line.substr(0, separator); ///< Extracts the character symbol from the line.
+            string code = line.substr(separator + 1); ///< Extracts the Huffman code from the line.
             if (symbol == "\\n") {
                 huffmanCodes[code] = '\n'; ///< Handles newline characters specially.
             }
@@ -182,71 +210,5960 @@ void DecodeFile(const string& encodedFileName, const string& huffFileName, const
         }
     }
     codeFile.close(); ///< Closes the Huffman code file.
+    return huffmanCodes;
+}
+
+/// @brief Decodes a file encoded with Huffman coding.
+/// @param encodedFileName The name of the file containing encoded data.
+/// @param huffFileName The name of the file containing Huffman codes.
+/// @param outputFileName The name of the file to write the decoded data.
+void DecodeFile(const string& encodedFileName, const string& huffFileName, const string& outputFileName) {
+    unordered_map<string, char> huffmanCodes = ReadHuffmanCodeFile(huffFileName); ///< Loads the code table.
 
     ofstream outputFile(outputFileName);
     DecodeBinaryFile(encodedFileName, outputFile, huffmanCodes); ///< Decodes the binary file and writes the output to a file.
     outputFile.close(); ///< Closes the output file stream.
 }
 
-/// @brief Calculates and displays the file size before and after compression.
-/// @param inputFileName The name of the input file.
-/// @param outputFileName The name of the output file.
-void FileSizeCompress(const string& inputFileName, const string& outputFileName) {
-    auto inputSize = fs::file_size(inputFileName); ///< Gets the size of the input file in bytes.
-    auto outputSize = fs::file_size(outputFileName); ///< Gets the size of the output file in bytes.
+/// @brief Index of the escape symbol, placed right after the 256 byte values.
+const unsigned EscapeSymbol = 256;
 
-    cout << "Compression completed!" << endl;
+/// @brief Number of symbols in the block alphabet (256 bytes plus the escape symbol).
+const unsigned BlockAlphabetSize = 257;
 
-    cout << "Original Size: " << inputSize << " bytes\n"; ///< Displays the original file size.
-    cout << "Compressed Size: " << outputSize << " bytes\n"; ///< Displays the compressed file size.
+/// @brief Number of bits resolved by a single decode table lookup.
+const unsigned DecodeTableBits = 11;
 
-    double compressionPercent = 100.0 * (1 - (double)outputSize / inputSize); ///< Calculates the compression percentage.
-    cout << "Compression Percentage: " << compressionPercent << "%\n"; ///< Displays the compression percentage.
+/// @brief Default number of input bytes per block.
+const size_t DefaultBlockSize = 128 * 1024;
+
+/// @brief Largest accepted block size, keeps code lengths well below 64 bits.
+const size_t MaxBlockSize = 16 * 1024 * 1024;
+
+/// @brief Magic bytes at the start of a block archive.
+const char BlockArchiveMagic[4] = { 'H', 'F', 'B', '1' };
+
+/// @enum BlockMode
+/// @brief How the payload of a block is coded.
+enum class BlockMode : uint8_t
+{
+    Huffman = 0, ///< Static Huffman table stored in front of the block as 257 raw code lengths.
+    LagOne = 1, ///< Table rebuilt from the previous block's histogram, nothing stored.
+    PackedHuffman = 2, ///< Static Huffman table stored in the smallest TableFormat for the block.
+    Raw = 3, ///< The block's bytes as they are, for input that does not compress.
+    PairHuffman = 4, ///< Like PackedHuffman, over an alphabet extended with the block's most frequent byte pairs.
+    Filtered = 5, ///< A filter byte and the mode of the filtered bytes (PackedHuffman, PairHuffman or Planes), then that mode's payload.
+    Planes = 6 ///< A plane count K, then K nested blocks (header and payload) holding byte k of every K-byte record.
+};
+
+/// @brief Number of block modes.
+const unsigned BlockModeCount = 7;
+
+/// @brief True for block modes that store their own table, such blocks decode independently.
+bool StoresTable(BlockMode mode)
+{
+    return mode == BlockMode::Huffman || mode == BlockMode::PackedHuffman || mode == BlockMode::PairHuffman || mode == BlockMode::Filtered
+        || mode == BlockMode::Planes;
 }
 
-/// @brief Calculates and displays the file size before and after decompression.
-/// @param inputFileName The name of the compressed input file.
-/// @param outputFileName The name of the decompressed output file.
-void FileSizeDecompress(const string& inputFileName, const string& outputFileName) {
-    auto inputSize = fs::file_size(inputFileName); ///< Gets the size of the compressed file in bytes.
-    auto outputSize = fs::file_size(outputFileName); ///< Gets the size of the decompressed file in bytes.
+/// @brief True for block modes that do not depend on the blocks before them.
+bool DecodesIndependently(BlockMode mode)
+{
+    return StoresTable(mode) || mode == BlockMode::Raw;
+}
 
-    cout << "Decompression completed!" << endl;
+/// @enum TableFormat
+/// @brief How the code lengths of a PackedHuffman block are stored, chosen per block by size.
+enum class TableFormat : uint8_t
+{
+    Raw = 0, ///< One byte per symbol of the alphabet.
+    Sparse = 1, ///< Count, coded byte symbols in ascending order, then 4-bit lengths (the escape's and any pairs' last).
+    RunLength = 2 ///< DEFLATE style: run-length tokens Huffman coded with a 19 symbol code-length code.
+};
 
-    cout << "Compressed Size: " << inputSize << " bytes\n"; ///< Displays the compressed file size.
-    cout << "Decompressed Size: " << outputSize << " bytes\n"; ///< Displays the decompressed file size.
+/// @brief Longest code length the Sparse and RunLength formats can store.
+const unsigned MaxPackedCodeLength = 15;
 
-    double decompressionIncreasePercent = 100.0 * ((double)outputSize / inputSize - 1); ///< Calculates the decompression increase percentage.
-    cout << "Decompression Increase Percentage: " << decompressionIncreasePercent << "%\n"; ///< Displays the decompression increase percentage.
+/// @brief Number of symbols of the code-length alphabet: lengths 0-15 and the three run tokens.
+const unsigned LengthCodeSymbols = 19;
+
+/// @brief Order in which the code-length code lengths are stored, rarely used ones last (as in DEFLATE).
+const uint8_t LengthCodeOrder[LengthCodeSymbols] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+/// @enum FilterKind
+/// @brief Reversible transform of fixed width little-endian elements applied before coding a Filtered block.
+///
+/// A filter byte holds the kind in its high nibble and the element width (1, 2, 4 or 8 bytes) in
+/// its low nibble. The first element is filtered against 0, trailing bytes that do not fill an
+/// element are left as they are.
+enum class FilterKind : uint8_t
+{
+    None = 0, ///< No filter.
+    Delta = 1, ///< Difference to the previous element, wrapping: slowly changing counters become small numbers.
+    Xor = 2, ///< XOR with the previous element: floating point values share sign, exponent and high mantissa bits.
+    Zigzag = 3, ///< Signed elements mapped to 0, -1, 1, -2, ... so small magnitudes get zero high bytes.
+    ZigzagDelta = 4 ///< Zigzag of the difference to the previous element, for signed deltas.
+};
+
+/// @brief Builds a filter byte.
+uint8_t MakeFilter(FilterKind kind, unsigned width)
+{
+    return static_cast<uint8_t>((static_cast<unsigned>(kind) << 4) | width);
 }
 
-/// @brief The main function handling command line arguments for compressing or decompressing files.
-/// @param argc Number of command line arguments.
-/// @param argv Array of command line arguments.
-/// @returns Returns 0 on successful execution, or 1 on error.
-int main(int argc, char* argv[]) {
-    if (argc != 4) {
-        cerr << "Usage: " << argv[0] << " <action> <input file> <output file>" << endl; ///< Checks for the correct number of arguments and displays usage instructions.
-        return 1; ///< Exits with an error code if the number of arguments is incorrect.
+/// @brief True for filter bytes a Filtered block may hold.
+bool IsValidFilter(uint8_t filter)
+{
+    unsigned kind = filter >> 4, width = filter & 15;
+    return kind >= 1 && kind <= 4 && (width == 1 || width == 2 || width == 4 || width == 8);
+}
+
+/// @brief Most byte pairs a PairHuffman block adds to its alphabet, as symbols 257 and up.
+const unsigned MaxPairSymbols = 64;
+
+/// @brief Fewest occurrences for a byte pair to be considered as a symbol of its own.
+const unsigned MinPairCount = 32;
+
+struct CodecMetrics;
+
+/// @struct BlockOptions
+/// @brief Settings for writing a block archive.
+struct BlockOptions
+{
+    size_t blockSize = DefaultBlockSize; ///< Number of input bytes per block.
+    bool lagOne = false; ///< Code each block with the table of the previous block.
+    bool lineIndex = false; ///< Write a ".lines" sidecar with the newline positions of every block.
+    unsigned threadCount = 1; ///< Number of threads coding independent blocks at the same time.
+    bool pipeline = false; ///< Compress files with a reader, threadCount encoders and a writer running concurrently.
+    bool verify = false; ///< Decode every block right after encoding it and compare it with the input.
+    bool prescreen = true; ///< Store blocks raw when magic bytes or a sampled entropy show they will not compress.
+    string metricsFileName; ///< Prometheus textfile written after the run, empty for none.
+    CodecMetrics* metrics = nullptr; ///< Receives counters and timings while metricsFileName is set.
+    unsigned topK = 0; ///< Static blocks give codes only to the K most frequent bytes and escape the rest, 0 codes every byte.
+    bool pairs = false; ///< Static blocks dominated by one byte may code frequent byte pairs as single symbols.
+    uint8_t filter = 0; ///< Filter byte applied to every static block, 0 for none, AutoFilter to pick one per block.
+    unsigned planes = 0; ///< Record width whose byte planes static blocks code with separate tables, 0 for none, AutoPlanes to pick per block.
+};
+
+/// @brief BlockOptions::topK value that picks K per block by exact cost.
+const unsigned AutoTopK = ~0u;
+
+/// @brief BlockOptions::filter value that picks the filter with the lowest sampled entropy per block.
+const uint8_t AutoFilter = 0xFF;
+
+/// @brief BlockOptions::planes value that picks the record width per block from sampled plane entropies.
+const unsigned AutoPlanes = ~0u;
+
+/// @brief Widest record a Planes block splits.
+const unsigned MaxPlanes = 16;
+
+/// @enum MetricStage
+/// @brief Pipeline stages whose latency and utilization are reported by --metrics.
+enum class MetricStage : unsigned
+{
+    Read, ///< Reading input.
+    Encode, ///< Coding blocks or files.
+    Verify, ///< Decoding and comparing with --verify.
+    Write, ///< Writing the archive.
+    Cluster, ///< Clustering files in batch mode.
+    Count ///< Number of stages.
+};
+
+/// @brief Label values of the stages, in MetricStage order.
+const char* const MetricStageNames[] = { "read", "encode", "verify", "write", "cluster" };
+
+/// @struct MetricHistogram
+/// @brief Prometheus style histogram that several threads can update without locks.
+struct MetricHistogram
+{
+    static const size_t MaxBuckets = 16; ///< Upper limit for the number of bounds.
+    vector<double> bounds; ///< Upper bounds of the buckets in ascending order, +Inf is implicit.
+    atomic<uint64_t> counts[MaxBuckets + 1] = {}; ///< Observations per bucket (not cumulative), the last one is +Inf.
+    atomic<uint64_t> count{ 0 }; ///< Number of observations.
+    atomic<double> sum{ 0 }; ///< Sum of the observed values.
+
+    /// @brief Records one value.
+    void Observe(double value)
+    {
+        counts[lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin()]++;
+        count++;
+        sum.fetch_add(value);
     }
+};
 
-    string action = argv[1]; ///< Stores the action ('c' for compress, 'd' for decompress).
-    string inputFileName = argv[2]; ///< Stores the name of the input file.
-    string outputFileName = argv[3]; ///< Stores the name of the output file.
+/// @struct CodecMetrics
+/// @brief Counters and histograms of one compression run, written in Prometheus text format by --metrics.
+struct CodecMetrics
+{
+    atomic<uint64_t> bytesIn{ 0 }; ///< Input bytes consumed.
+    atomic<uint64_t> bytesOut{ 0 }; ///< Archive bytes produced.
+    atomic<uint64_t> blocks[BlockModeCount] = {}; ///< Blocks (or batch files) written, indexed by BlockMode.
+    atomic<uint64_t> tableCacheHits{ 0 }; ///< Blocks coded with a table that already existed (lag-one, shared batch tables).
+    atomic<uint64_t> tableCacheMisses{ 0 }; ///< Blocks that needed a new table.
+    MetricHistogram stageSeconds[static_cast<unsigned>(MetricStage::Count)]; ///< Latency of one unit of work per stage.
+    unsigned stageThreads[static_cast<unsigned>(MetricStage::Count)] = {}; ///< Threads working in each stage.
+    MetricHistogram encodeQueueDepth; ///< Blocks waiting for an encoder, sampled by the encoders (--pipeline).
+    MetricHistogram writeQueueDepth; ///< Blocks waiting for the writer, sampled by the writer (--pipeline).
+    chrono::steady_clock::time_point start = chrono::steady_clock::now(); ///< Start of the run.
+
+    CodecMetrics()
+    {
+        for (MetricHistogram& histogram : stageSeconds)
+            histogram.bounds = { 1e-5, 5e-5, 1e-4, 5e-4, 1e-3, 5e-3, 0.01, 0.05, 0.1, 0.5, 1, 5 };
+        encodeQueueDepth.bounds = writeQueueDepth.bounds = { 0, 1, 2, 4, 8 };
+    }
+
+    /// @brief Records the duration of one unit of work.
+    void ObserveStage(MetricStage stage, double seconds)
+    {
+        stageSeconds[static_cast<unsigned>(stage)].Observe(seconds);
+    }
+
+    /// @brief Counts one written block and whether its table came from the cache.
+    void CountBlock(BlockMode mode)
+    {
+        blocks[static_cast<unsigned>(mode)]++;
+        if (mode == BlockMode::LagOne)
+            tableCacheHits++;
+        else if (StoresTable(mode))
+            tableCacheMisses++;
+    }
+};
+
+/// @struct StageTimer
+/// @brief Times a scope and records it as one unit of work of a stage, does nothing without metrics.
+struct StageTimer
+{
+    CodecMetrics* metrics; ///< Destination, may be null.
+    MetricStage stage; ///< The stage being timed.
+    chrono::steady_clock::time_point start; ///< Start of the scope.
+
+    StageTimer(CodecMetrics* metrics, MetricStage stage)
+        : metrics(metrics), stage(stage), start(metrics ? chrono::steady_clock::now() : chrono::steady_clock::time_point()) {}
+
+    /// @brief Records the time so far and disarms the timer.
+    void Stop()
+    {
+        if (metrics)
+            metrics->ObserveStage(stage, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+        metrics = nullptr;
+    }
+
+    ~StageTimer()
+    {
+        Stop();
+    }
+};
+
+/// @brief Writes one histogram in Prometheus text format.
+void WriteMetricHistogram(ostream& output, const string& name, const string& labels, const MetricHistogram& histogram)
+{
+    uint64_t cumulative = 0;
+    for (size_t bucket = 0; bucket <= histogram.bounds.size(); bucket++)
+    {
+        cumulative += histogram.counts[bucket];
+        ostringstream bound;
+        if (bucket < histogram.bounds.size())
+            bound << histogram.bounds[bucket];
+        else
+            bound << "+Inf";
+        output << name << "_bucket{" << labels << (labels.empty() ? "" : ",") << "le=\"" << bound.str() << "\"} " << cumulative << '\n';
+    }
+    string suffix = labels.empty() ? "" : "{" + labels + "}";
+    output << name << "_sum" << suffix << ' ' << histogram.sum.load() << '\n';
+    output << name << "_count" << suffix << ' ' << histogram.count.load() << '\n';
+}
+
+/// @brief Writes the metrics of a run as a Prometheus textfile (e.g. for node_exporter's textfile collector).
+///
+/// The file is written under a temporary name and renamed, so a scraper never sees half of it.
+/// @param metrics The metrics.
+/// @param fileName The textfile.
+void WriteMetricsFile(const CodecMetrics& metrics, const string& fileName)
+{
+    ostringstream output;
+    output << "# HELP huffman_bytes_in_total Input bytes consumed.\n# TYPE huffman_bytes_in_total counter\n";
+    output << "huffman_bytes_in_total " << metrics.bytesIn << '\n';
+    output << "# HELP huffman_bytes_out_total Archive bytes produced.\n# TYPE huffman_bytes_out_total counter\n";
+    output << "huffman_bytes_out_total " << metrics.bytesOut << '\n';
+
+    static const char* const modeNames[BlockModeCount] = { "huffman", "lag_one", "packed_huffman", "raw", "pair_huffman", "filtered", "planes" };
+    output << "# HELP huffman_blocks_total Blocks written, by block mode.\n# TYPE huffman_blocks_total counter\n";
+    for (unsigned mode = 0; mode < BlockModeCount; mode++)
+        output << "huffman_blocks_total{mode=\"" << modeNames[mode] << "\"} " << metrics.blocks[mode] << '\n';
+
+    uint64_t hits = metrics.tableCacheHits, misses = metrics.tableCacheMisses;
+    output << "# HELP huffman_table_cache_hits_total Blocks coded with an existing table (lag-one or shared batch table).\n";
+    output << "# TYPE huffman_table_cache_hits_total counter\nhuffman_table_cache_hits_total " << hits << '\n';
+    output << "# HELP huffman_table_cache_misses_total Blocks that needed a new table.\n";
+    output << "# TYPE huffman_table_cache_misses_total counter\nhuffman_table_cache_misses_total " << misses << '\n';
+    output << "# HELP huffman_table_cache_hit_ratio Share of table lookups served by an existing table.\n";
+    output << "# TYPE huffman_table_cache_hit_ratio gauge\nhuffman_table_cache_hit_ratio " << (hits + misses > 0 ? double(hits) / (hits + misses) : 0) << '\n';
+
+    double wallSeconds = chrono::duration<double>(chrono::steady_clock::now() - metrics.start).count();
+    output << "# HELP huffman_run_duration_seconds Wall time of the run.\n# TYPE huffman_run_duration_seconds gauge\n";
+    output << "huffman_run_duration_seconds " << wallSeconds << '\n';
+
+    output << "# HELP huffman_stage_duration_seconds Time per unit of work (block or file) of each stage.\n";
+    output << "# TYPE huffman_stage_duration_seconds histogram\n";
+    for (unsigned stage = 0; stage < static_cast<unsigned>(MetricStage::Count); stage++)
+        if (metrics.stageThreads[stage] > 0)
+            WriteMetricHistogram(output, "huffman_stage_duration_seconds", string("stage=\"") + MetricStageNames[stage] + "\"", metrics.stageSeconds[stage]);
+    output << "# HELP huffman_stage_threads Threads working in each stage.\n# TYPE huffman_stage_threads gauge\n";
+    for (unsigned stage = 0; stage < static_cast<unsigned>(MetricStage::Count); stage++)
+        if (metrics.stageThreads[stage] > 0)
+            output << "huffman_stage_threads{stage=\"" << MetricStageNames[stage] << "\"} " << metrics.stageThreads[stage] << '\n';
+    output << "# HELP huffman_thread_utilization Busy share of the threads of each stage over the run.\n# TYPE huffman_thread_utilization gauge\n";
+    for (unsigned stage = 0; stage < static_cast<unsigned>(MetricStage::Count); stage++)
+        if (metrics.stageThreads[stage] > 0)
+            output << "huffman_thread_utilization{stage=\"" << MetricStageNames[stage] << "\"} "
+                << (wallSeconds > 0 ? metrics.stageSeconds[stage].sum / (wallSeconds * metrics.stageThreads[stage]) : 0) << '\n';
+
+    output << "# HELP huffman_queue_depth Blocks waiting in a pipeline ring when a stage takes one.\n# TYPE huffman_queue_depth histogram\n";
+    WriteMetricHistogram(output, "huffman_queue_depth", "queue=\"encode\"", metrics.encodeQueueDepth);
+    WriteMetricHistogram(output, "huffman_queue_depth", "queue=\"write\"", metrics.writeQueueDepth);
+
+    string temporaryName = fileName + ".tmp";
+    ofstream file(temporaryName, ios::binary);
+    file << output.str();
+    file.close();
+    if (!file)
+        throw runtime_error("Cannot write " + temporaryName);
+    fs::rename(temporaryName, fileName);
+}
+
+/// @struct BitWriter
+/// @brief Appends bit sequences (most significant bit first) to a byte string.
+struct BitWriter
+{
+    string& output; ///< Destination byte string.
+    uint64_t buffer = 0; ///< Pending bits, the lowest `count` bits are valid.
+    unsigned count = 0; ///< Number of pending bits (always below 8 between calls).
+
+    explicit BitWriter(string& output) : output(output) {}
+
+    /// @brief Writes the lowest `length` bits of `bits`.
+    void Write(uint64_t bits, unsigned length)
+    {
+        if (length > 32)
+        {
+            Write(bits >> 32, length - 32); ///< Splits long codes so the buffer never overflows.
+            length = 32;
+        }
+        buffer = (buffer << length) | (bits & ((uint64_t(1) << length) - 1));
+        count += length;
+        while (count >= 8)
+        {
+            count -= 8;
+            output.push_back(static_cast<char>(buffer >> count));
+        }
+    }
 
-    if (action == "c") {
-        string text = ReadFile(inputFileName); ///< Reads the input file.
-        priority_queue<TreeNode*, vector<TreeNode*>, CompareNodes> pq; ///< Creates a priority queue for building the Huffman tree.
-        BuildHuffmanTree(text, outputFileName, pq); ///< Builds the Huffman tree and encodes the file.
-        FileSizeCompress(inputFileName, outputFileName); ///< Displays the file size before and after compression.
+    /// @brief Pads the last partial byte with zero bits and writes it.
+    void Flush()
+    {
+        if (count > 0)
+            output.push_back(static_cast<char>(buffer << (8 - count)));
+        buffer = 0;
+        count = 0;
+    }
+};
+
+/// @struct BitReader
+/// @brief Reads bit sequences (most significant bit first) from a byte range.
+///
+/// Reading past the end yields zero bits, callers know how many symbols to expect.
+struct BitReader
+{
+    const unsigned char* data; ///< Start of the byte range.
+    size_t size; ///< Length of the byte range.
+    size_t position = 0; ///< Next byte to load into the buffer.
+    uint64_t buffer = 0; ///< Loaded bits, left aligned.
+    unsigned count = 0; ///< Number of valid bits in the buffer.
+
+    BitReader(const char* data, size_t size) : data(reinterpret_cast<const unsigned char*>(data)), size(size) {}
+
+    /// @brief Tops up the buffer to at least 57 valid bits.
+    void Refill()
+    {
+        while (count <= 56)
+        {
+            uint64_t byte = position < size ? data[position] : 0;
+            buffer |= byte << (56 - count);
+            position++;
+            count += 8;
+        }
+    }
+
+    /// @brief Returns the next `length` bits (1 to 56) without consuming them.
+    uint64_t Peek(unsigned length)
+    {
+        Refill();
+        return buffer >> (64 - length);
+    }
+
+    /// @brief Consumes `length` bits that were previously peeked.
+    void Skip(unsigned length)
+    {
+        buffer <<= length;
+        count -= length;
+    }
+
+    /// @brief Reads and consumes the next `length` bits (1 to 56).
+    uint64_t Read(unsigned length)
+    {
+        uint64_t bits = Peek(length);
+        Skip(length);
+        return bits;
+    }
+};
+
+/// @struct HuffmanTable
+/// @brief Canonical Huffman code over a symbol alphabet.
+struct HuffmanTable
+{
+    pmr::vector<unsigned> codeLengths; ///< Code length of every symbol, 0 if the symbol has no code.
+    pmr::vector<uint64_t> codes; ///< Canonical code of every symbol.
+    pmr::vector<uint16_t> pairs; ///< Byte pairs (first byte in the high bits) of the symbols after the escape, PairHuffman only.
+
+    explicit HuffmanTable(pmr::memory_resource* resource = pmr::get_default_resource()) : codeLengths(resource), codes(resource), pairs(resource) {}
+};
+
+/// @struct HuffmanDecoder
+/// @brief Table driven decoder for a canonical Huffman code.
+struct HuffmanDecoder
+{
+    pmr::vector<uint32_t> table; ///< Lookup by the next tableBits bits, (symbol << 8) | length, 0 if the code is longer.
+    pmr::vector<unsigned> lengthCounts; ///< Number of codes of every length, used for codes longer than the table.
+    pmr::vector<unsigned> sortedSymbols; ///< Symbols ordered by (code length, symbol).
+    pmr::vector<uint16_t> pairs; ///< Byte pairs of the symbols after the escape, copied from the table.
+    unsigned tableBits = DecodeTableBits; ///< Bits indexing the lookup table, wide alphabets use more.
+
+    explicit HuffmanDecoder(pmr::memory_resource* resource = pmr::get_default_resource())
+        : table(resource), lengthCounts(resource), sortedSymbols(resource), pairs(resource) {}
+};
+
+/// @brief Longest supported code length (blocks are small enough to stay far below it).
+const unsigned MaxCodeLength = 64;
+
+/// @struct HuffmanScratch
+/// @brief Reusable memory for building and storing Huffman tables, so doing so allocates nothing once warmed up.
+struct HuffmanScratch
+{
+    pmr::vector<TreeNode> nodes; ///< Node pool, reserved up front so pointers into it stay valid.
+    pmr::vector<TreeNode*> heap; ///< Min-heap of subtree roots ordered by CompareNodes.
+    pmr::vector<uint16_t> lengthTokens; ///< Run-length tokens of a stored table, symbol | (extra bits << 5).
+    pmr::vector<unsigned> lengthHistogram; ///< Frequencies of the code-length alphabet.
+    HuffmanTable lengthTable; ///< Code-length code of a RunLength table.
+    HuffmanDecoder lengthDecoder; ///< Decoder of lengthTable.
+    pmr::vector<unsigned> symbolOrder; ///< Bytes by decreasing frequency, for top-K tables.
+    pmr::vector<unsigned> escapeHistogram; ///< Histogram with the escaped bytes folded into the escape symbol.
+
+    explicit HuffmanScratch(pmr::memory_resource* resource = pmr::get_default_resource())
+        : nodes(resource), heap(resource), lengthTokens(resource), lengthHistogram(resource), lengthTable(resource), lengthDecoder(resource),
+        symbolOrder(resource), escapeHistogram(resource) {}
+};
+
+/// @brief Builds a Huffman tree from a histogram indexed by symbol.
+/// @param histogram Frequency of every symbol, symbols with frequency 0 get no leaf.
+/// @param scratch Memory for the nodes and the heap, the tree lives until the next build.
+/// @returns Root of the tree, or nullptr if the histogram is empty.
+TreeNode* BuildTreeFromHistogram(const pmr::vector<unsigned>& histogram, HuffmanScratch& scratch)
+{
+    scratch.nodes.clear();
+    scratch.nodes.reserve(2 * histogram.size());
+    scratch.heap.clear();
+    for (unsigned symbol = 0; symbol < histogram.size(); symbol++)
+        if (histogram[symbol] > 0)
+        {
+            scratch.nodes.emplace_back(symbol, histogram[symbol]);
+            scratch.heap.push_back(&scratch.nodes.back());
+        }
+    make_heap(scratch.heap.begin(), scratch.heap.end(), CompareNodes());
+
+    if (scratch.heap.empty())
+        return nullptr;
+
+    unsigned nextSymbol = static_cast<unsigned>(histogram.size()); ///< Internal nodes get unique symbols after the alphabet to keep ties ordered.
+    while (scratch.heap.size() != 1)
+    {
+        pop_heap(scratch.heap.begin(), scratch.heap.end(), CompareNodes());
+        TreeNode* leftNode = scratch.heap.back(); scratch.heap.pop_back();
+        pop_heap(scratch.heap.begin(), scratch.heap.end(), CompareNodes());
+        TreeNode* rightNode = scratch.heap.back(); scratch.heap.pop_back();
+        scratch.nodes.emplace_back(nextSymbol++, leftNode->frequency + rightNode->frequency);
+        TreeNode* parentNode = &scratch.nodes.back();
+        parentNode->left = leftNode;
+        parentNode->right = rightNode;
+        scratch.heap.push_back(parentNode);
+        push_heap(scratch.heap.begin(), scratch.heap.end(), CompareNodes());
+    }
+    return scratch.heap.front();
+}
+
+/// @brief Stores the depth of every leaf as the code length of its symbol.
+/// @param root Pointer to the current node.
+/// @param depth Depth of the current node.
+/// @param codeLengths Code lengths indexed by symbol.
+void GenerateCodeLengths(TreeNode* root, unsigned depth, pmr::vector<unsigned>& codeLengths)
+{
+    if (root == nullptr)
+        return;
+
+    if (!root->left && !root->right)
+        codeLengths[root->symbol] = max(depth, 1u); ///< A lone leaf still needs a one bit code.
+
+    GenerateCodeLengths(root->left, depth + 1, codeLengths);
+    GenerateCodeLengths(root->right, depth + 1, codeLengths);
+}
+
+/// @brief Assigns canonical codes to the code lengths of a table.
+///
+/// Codes are ordered by (length, symbol), computed from the number of codes per length as in DEFLATE.
+/// @param table The table whose codes are filled in.
+void AssignCanonicalCodes(HuffmanTable& table)
+{
+    unsigned lengthCounts[MaxCodeLength + 1] = {};
+    for (unsigned length : table.codeLengths)
+    {
+        if (length > MaxCodeLength)
+            throw runtime_error("Huffman code length is too long.");
+        lengthCounts[length]++;
+    }
+    lengthCounts[0] = 0;
+
+    uint64_t nextCode[MaxCodeLength + 1] = {};
+    uint64_t code = 0;
+    uint64_t unusedCodes = 1; ///< Codes of the current length left by shorter ones, capped far above any alphabet size.
+    for (unsigned length = 1; length <= MaxCodeLength; length++)
+    {
+        code = (code + lengthCounts[length - 1]) << 1; ///< First code of each length follows the last code of the previous one.
+        nextCode[length] = code;
+        unusedCodes = min<uint64_t>(unusedCodes * 2, uint64_t(1) << 32);
+        if (lengthCounts[length] > unusedCodes)
+            throw runtime_error("Invalid Huffman table in block archive."); ///< Over-subscribed lengths (Kraft sum above 1) would overflow their code length.
+        unusedCodes -= lengthCounts[length];
+    }
+
+    table.codes.resize(table.codeLengths.size());
+    for (unsigned symbol = 0; symbol < table.codeLengths.size(); symbol++)
+        table.codes[symbol] = table.codeLengths[symbol] > 0 ? nextCode[table.codeLengths[symbol]]++ : 0;
+}
+
+/// @brief Builds a canonical Huffman table from a histogram into reused memory.
+/// @param histogram Frequency of every symbol.
+/// @param table Receives the code lengths and canonical codes.
+/// @param scratch Memory for the tree.
+void BuildHuffmanTable(const pmr::vector<unsigned>& histogram, HuffmanTable& table, HuffmanScratch& scratch)
+{
+    table.codeLengths.assign(histogram.size(), 0);
+    GenerateCodeLengths(BuildTreeFromHistogram(histogram, scratch), 0, table.codeLengths);
+    AssignCanonicalCodes(table);
+}
+
+/// @brief Builds a canonical Huffman table from a histogram.
+/// @param histogram Frequency of every symbol.
+/// @returns The table with code lengths and canonical codes.
+HuffmanTable BuildHuffmanTable(const pmr::vector<unsigned>& histogram)
+{
+    HuffmanTable table;
+    HuffmanScratch scratch;
+    BuildHuffmanTable(histogram, table, scratch);
+    return table;
+}
+
+/// @brief Builds the decoder for a canonical Huffman table into reused memory.
+/// @param table Table with code lengths and canonical codes.
+/// @param decoder Receives the lookup table and the canonical ordering.
+/// @param tableBits Bits indexing the lookup table, codes up to this length decode in one lookup.
+void BuildHuffmanDecoder(const HuffmanTable& table, HuffmanDecoder& decoder, unsigned tableBits = DecodeTableBits)
+{
+    decoder.tableBits = tableBits;
+    decoder.table.assign(size_t(1) << tableBits, 0);
+    unsigned maxLength = 0;
+    for (unsigned length : table.codeLengths)
+        maxLength = max(maxLength, length);
+    decoder.lengthCounts.assign(maxLength + 1, 0);
+
+    size_t codeCount = 0;
+    for (unsigned symbol = 0; symbol < table.codeLengths.size(); symbol++)
+    {
+        unsigned length = table.codeLengths[symbol];
+        if (length == 0)
+            continue;
+        decoder.lengthCounts[length]++;
+        codeCount++;
+        if (length <= tableBits)
+        {
+            size_t first = size_t(table.codes[symbol]) << (tableBits - length); ///< Every table slot starting with the code decodes to the symbol.
+            size_t last = first + (size_t(1) << (tableBits - length));
+            if (last > decoder.table.size())
+                throw runtime_error("Invalid Huffman table in block archive.");
+            for (size_t slot = first; slot < last; slot++)
+                decoder.table[slot] = (symbol << 8) | length;
+        }
+    }
+
+    size_t lengthStarts[MaxCodeLength + 1] = {}; ///< Counting sort of the symbols by code length.
+    for (unsigned length = 2; length <= maxLength; length++)
+        lengthStarts[length] = lengthStarts[length - 1] + decoder.lengthCounts[length - 1];
+    decoder.sortedSymbols.resize(codeCount);
+    for (unsigned symbol = 0; symbol < table.codeLengths.size(); symbol++)
+        if (table.codeLengths[symbol] > 0)
+            decoder.sortedSymbols[lengthStarts[table.codeLengths[symbol]]++] = symbol;
+    decoder.pairs.assign(table.pairs.begin(), table.pairs.end());
+}
+
+/// @brief Builds the decoder for a canonical Huffman table.
+/// @param table Table with code lengths and canonical codes.
+/// @returns The decoder.
+HuffmanDecoder BuildHuffmanDecoder(const HuffmanTable& table)
+{
+    HuffmanDecoder decoder;
+    BuildHuffmanDecoder(table, decoder);
+    return decoder;
+}
+
+/// @brief Decodes one symbol.
+/// @param decoder The decoder of the current table.
+/// @param reader The bit source.
+/// @returns The decoded symbol.
+unsigned DecodeSymbol(const HuffmanDecoder& decoder, BitReader& reader)
+{
+    uint32_t entry = decoder.table[reader.Peek(decoder.tableBits)];
+    if (entry != 0)
+    {
+        reader.Skip(entry & 0xFF); ///< Fast path: the whole code fits in the lookup table.
+        return entry >> 8;
+    }
+
+    uint64_t code = 0, first = 0; ///< Slow path: walk the canonical code one bit at a time.
+    unsigned index = 0;
+    for (unsigned length = 1; length < decoder.lengthCounts.size(); length++)
+    {
+        code |= reader.Read(1);
+        unsigned count = decoder.lengthCounts[length];
+        if (code - first < count)
+            return decoder.sortedSymbols[index + (code - first)];
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    throw runtime_error("Invalid Huffman code in block.");
+}
+
+/// @struct ByteSpan
+/// @brief Read-only view of a contiguous byte range, one element of a scatter/gather list.
+struct ByteSpan
+{
+    const char* data; ///< Start of the range.
+    size_t size; ///< Length of the range.
+};
+
+/// @struct MutableByteSpan
+/// @brief Writable view of a contiguous byte range, one element of a scatter/gather list.
+struct MutableByteSpan
+{
+    char* data; ///< Start of the range.
+    size_t size; ///< Length of the range.
+};
+
+/// @struct SpanCursor
+/// @brief Walks a list of spans as one logical byte sequence, handing out consecutive ranges without copying.
+template <typename Span>
+struct SpanCursor
+{
+    const Span* spans; ///< The scatter/gather list.
+    size_t spanCount; ///< Number of spans in the list.
+    size_t index = 0; ///< Current span.
+    size_t offset = 0; ///< Offset inside the current span.
+
+    SpanCursor(const Span* spans, size_t spanCount) : spans(spans), spanCount(spanCount) {}
+    explicit SpanCursor(const vector<Span>& spans) : SpanCursor(spans.data(), spans.size()) {}
+
+    /// @brief Returns the pieces of the next `length` logical bytes (fewer at the end of the list).
+    pmr::vector<Span> Take(size_t length)
+    {
+        pmr::vector<Span> pieces;
+        Take(length, pieces);
+        return pieces;
+    }
+
+    /// @brief Stores the pieces of the next `length` logical bytes in a reused list.
+    void Take(size_t length, pmr::vector<Span>& pieces)
+    {
+        pieces.clear();
+        while (length > 0 && index < spanCount)
+        {
+            size_t count = min(length, spans[index].size - offset);
+            if (count > 0)
+                pieces.push_back({ spans[index].data + offset, count });
+            offset += count;
+            length -= count;
+            if (offset == spans[index].size)
+            {
+                index++;
+                offset = 0;
+            }
+        }
     }
-    else if (action == "d") {
-        DecodeFile(inputFileName, inputFileName + ".huff", outputFileName); ///< Decodes the file.
-        FileSizeDecompress(inputFileName, outputFileName); ///< Displays the file size before and after decompression.
+};
+
+/// @brief Total number of bytes in a list of spans.
+template <typename SpanList>
+uint64_t TotalSize(const SpanList& spans)
+{
+    uint64_t size = 0;
+    for (const auto& span : spans)
+        size += span.size;
+    return size;
+}
+
+/// @brief Counts the bytes of a range into a block histogram.
+/// @param data Start of the range.
+/// @param size Length of the range.
+/// @returns Frequency of every symbol of the block alphabet.
+pmr::vector<unsigned> CountSymbols(const char* data, size_t size)
+{
+    pmr::vector<unsigned> histogram(BlockAlphabetSize, 0);
+    for (size_t i = 0; i < size; i++)
+        histogram[static_cast<unsigned char>(data[i])]++;
+    return histogram;
+}
+
+/// @brief Counts the bytes of a scatter/gather list into a reused block histogram.
+/// @param pieces The ranges, treated as one logical block.
+/// @param histogram Receives the frequency of every symbol of the block alphabet.
+void CountSymbols(const pmr::vector<ByteSpan>& pieces, pmr::vector<unsigned>& histogram)
+{
+    histogram.assign(BlockAlphabetSize, 0);
+    for (const ByteSpan& piece : pieces)
+        for (size_t i = 0; i < piece.size; i++)
+            histogram[static_cast<unsigned char>(piece.data[i])]++;
+}
+
+/// @brief Counts the bytes of a scatter/gather list into one block histogram.
+/// @param pieces The ranges, treated as one logical block.
+/// @returns Frequency of every symbol of the block alphabet.
+pmr::vector<unsigned> CountSymbols(const pmr::vector<ByteSpan>& pieces)
+{
+    pmr::vector<unsigned> histogram;
+    CountSymbols(pieces, histogram);
+    return histogram;
+}
+
+/// @brief Appends a 32-bit little-endian integer to a byte string.
+void AppendUint32(string& output, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        output.push_back(static_cast<char>(value >> (8 * i)));
+}
+
+/// @brief Appends a 64-bit little-endian integer to a byte string.
+void AppendUint64(string& output, uint64_t value)
+{
+    AppendUint32(output, static_cast<uint32_t>(value));
+    AppendUint32(output, static_cast<uint32_t>(value >> 32));
+}
+
+/// @brief Reads a 32-bit little-endian integer from four bytes the caller has checked.
+uint32_t LoadUint32(const char* bytes)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++)
+        value |= uint32_t(static_cast<unsigned char>(bytes[i])) << (8 * i);
+    return value;
+}
+
+/// @brief Reads a 32-bit little-endian integer and advances the offset.
+uint32_t ReadUint32(const string& input, size_t& offset)
+{
+    if (offset + 4 > input.size())
+        throw runtime_error("Unexpected end of block archive.");
+    uint32_t value = LoadUint32(input.data() + offset);
+    offset += 4;
+    return value;
+}
+
+/// @brief Reads a 64-bit little-endian integer and advances the offset.
+uint64_t ReadUint64(const string& input, size_t& offset)
+{
+    uint64_t low = ReadUint32(input, offset);
+    return low | (uint64_t(ReadUint32(input, offset)) << 32);
+}
+
+/// @struct BlockHeader
+/// @brief Fixed size header in front of every block of an archive.
+struct BlockHeader
+{
+    BlockMode mode; ///< How the payload is coded.
+    uint32_t rawSize; ///< Number of decoded bytes.
+    uint32_t payloadSize; ///< Number of payload bytes following the header.
+};
+
+/// @brief Size of a serialized BlockHeader in bytes.
+const size_t BlockHeaderSize = 9;
+
+/// @brief Reads a block header and advances the offset.
+BlockHeader ReadBlockHeader(const string& input, size_t& offset)
+{
+    if (offset >= input.size())
+        throw runtime_error("Unexpected end of block archive.");
+    BlockHeader header;
+    header.mode = static_cast<BlockMode>(input[offset++]);
+    header.rawSize = ReadUint32(input, offset);
+    header.payloadSize = ReadUint32(input, offset);
+    return header;
+}
+
+/// @brief Writes the symbols of a block with a table, escaping symbols the table has no code for.
+/// @param pieces The ranges of the block, coded as one bit stream.
+/// @param table The table to code with.
+/// @param writer The bit destination.
+/// @param histogram Receives the byte frequencies of the block while it is coded.
+void EncodeSymbols(const pmr::vector<ByteSpan>& pieces, const HuffmanTable& table, BitWriter& writer, pmr::vector<unsigned>& histogram)
+{
+    for (const ByteSpan& piece : pieces)
+        for (size_t i = 0; i < piece.size; i++)
+        {
+            unsigned char byte = static_cast<unsigned char>(piece.data[i]);
+            histogram[byte]++;
+            if (table.codeLengths[byte] > 0)
+                writer.Write(table.codes[byte], table.codeLengths[byte]);
+            else
+            {
+                writer.Write(table.codes[EscapeSymbol], table.codeLengths[EscapeSymbol]); ///< Unseen symbol: escape code followed by the raw byte.
+                writer.Write(byte, 8);
+            }
+        }
+}
+
+/// @brief Splits a block into byte and byte-pair symbols, taking a pair whenever the next two bytes form one.
+/// @param pieces The ranges of the block, pairs may straddle them.
+/// @param pairSymbols Symbol of every byte pair (first byte in the high bits), 0 for pairs without one.
+/// @param emit Called with every symbol in order.
+template <typename Function>
+void ForEachPairSymbol(const pmr::vector<ByteSpan>& pieces, const pmr::vector<uint16_t>& pairSymbols, Function emit)
+{
+    bool pending = false; ///< The previous byte is not coded yet.
+    unsigned previous = 0;
+    for (const ByteSpan& piece : pieces)
+        for (size_t i = 0; i < piece.size; i++)
+        {
+            unsigned byte = static_cast<unsigned char>(piece.data[i]);
+            if (!pending)
+            {
+                previous = byte;
+                pending = true;
+                continue;
+            }
+            unsigned symbol = pairSymbols[(previous << 8) | byte];
+            if (symbol != 0)
+            {
+                emit(symbol);
+                pending = false;
+            }
+            else
+            {
+                emit(previous);
+                previous = byte;
+            }
+        }
+    if (pending)
+        emit(previous);
+}
+
+/// @brief Number of extra bits following a code-length token.
+unsigned LengthTokenExtraBits(unsigned symbol)
+{
+    return symbol == 16 ? 2 : symbol == 17 ? 3 : symbol == 18 ? 7 : 0;
+}
+
+/// @brief Splits code lengths into DEFLATE style tokens: literal lengths 0-15, 16 = repeat the
+/// previous length 3-6 times, 17 = 3-10 zeros, 18 = 11-138 zeros.
+/// @param codeLengths The code lengths, all at most MaxPackedCodeLength.
+/// @param tokens Receives the tokens, symbol | (extra bits << 5).
+void TokenizeCodeLengths(const pmr::vector<unsigned>& codeLengths, pmr::vector<uint16_t>& tokens)
+{
+    tokens.clear();
+    size_t i = 0;
+    while (i < codeLengths.size())
+    {
+        unsigned length = codeLengths[i];
+        size_t run = 1;
+        while (i + run < codeLengths.size() && codeLengths[i + run] == length)
+            run++;
+        i += run;
+        if (length == 0)
+        {
+            for (; run >= 11; run -= min<size_t>(run, 138))
+                tokens.push_back(static_cast<uint16_t>(18 | ((min<size_t>(run, 138) - 11) << 5)));
+            if (run >= 3)
+            {
+                tokens.push_back(static_cast<uint16_t>(17 | ((run - 3) << 5)));
+                run = 0;
+            }
+        }
+        else
+        {
+            tokens.push_back(static_cast<uint16_t>(length));
+            for (run--; run >= 3; run -= min<size_t>(run, 6))
+                tokens.push_back(static_cast<uint16_t>(16 | ((min<size_t>(run, 6) - 3) << 5)));
+        }
+        for (; run > 0; run--)
+            tokens.push_back(static_cast<uint16_t>(length));
+    }
+}
+
+/// @struct StoredTablePlan
+/// @brief The smallest way to store a table, as chosen by PlanStoredTable.
+struct StoredTablePlan
+{
+    TableFormat format; ///< The chosen format.
+    size_t size; ///< Bytes the stored table takes, including the format byte.
+    unsigned codedBytes; ///< Number of byte symbols with a code.
+    unsigned storedLengthCodes; ///< Number of code-length code lengths a RunLength table stores.
+};
+
+/// @brief Sizes every TableFormat for a table exactly and picks the smallest.
+///
+/// Small blocks use few symbols, so a sparse list or run-length coded lengths take a few dozen
+/// bytes instead of 257. Pair symbols after the escape are stored like it, one length each.
+/// @param table The table.
+/// @param scratch Receives the run-length tokens and the code-length code used by WriteStoredTable.
+/// @returns The plan.
+StoredTablePlan PlanStoredTable(const HuffmanTable& table, HuffmanScratch& scratch)
+{
+    size_t alphabetSize = table.codeLengths.size();
+    size_t rawSize = 1 + alphabetSize;
+    size_t sparseSize = SIZE_MAX, runLengthSize = SIZE_MAX;
+    unsigned maxLength = 0, codedBytes = 0;
+    for (unsigned symbol = 0; symbol < alphabetSize; symbol++)
+    {
+        maxLength = max(maxLength, table.codeLengths[symbol]);
+        codedBytes += symbol < 256 && table.codeLengths[symbol] > 0;
+    }
+    unsigned storedLengthCodes = 0;
+    if (maxLength <= MaxPackedCodeLength)
+    {
+        if (codedBytes < 256)
+            sparseSize = 2 + codedBytes + (codedBytes + alphabetSize - BlockAlphabetSize + 2) / 2; ///< One nibble per coded byte, then the escape's and the pairs'.
+
+        TokenizeCodeLengths(table.codeLengths, scratch.lengthTokens);
+        scratch.lengthHistogram.assign(LengthCodeSymbols, 0);
+        for (uint16_t token : scratch.lengthTokens)
+            scratch.lengthHistogram[token & 31]++;
+        BuildHuffmanTable(scratch.lengthHistogram, scratch.lengthTable, scratch);
+        unsigned maxLengthCode = *max_element(scratch.lengthTable.codeLengths.begin(), scratch.lengthTable.codeLengths.end());
+        if (maxLengthCode <= MaxPackedCodeLength) ///< Code-length code lengths are stored in 4 bits; large alphabets can skew the tokens past that.
+        {
+            storedLengthCodes = LengthCodeSymbols;
+            while (storedLengthCodes > 4 && scratch.lengthTable.codeLengths[LengthCodeOrder[storedLengthCodes - 1]] == 0)
+                storedLengthCodes--; ///< Trailing unused code-length codes are not stored.
+            size_t bits = 4 + 4 * storedLengthCodes;
+            for (uint16_t token : scratch.lengthTokens)
+                bits += scratch.lengthTable.codeLengths[token & 31] + LengthTokenExtraBits(token & 31);
+            runLengthSize = 1 + (bits + 7) / 8;
+        }
+    }
+
+    if (rawSize <= sparseSize && rawSize <= runLengthSize)
+        return { TableFormat::Raw, rawSize, codedBytes, storedLengthCodes };
+    if (sparseSize <= runLengthSize)
+        return { TableFormat::Sparse, sparseSize, codedBytes, storedLengthCodes };
+    return { TableFormat::RunLength, runLengthSize, codedBytes, storedLengthCodes };
+}
+
+/// @brief Writes the code lengths of a table in front of a PackedHuffman block payload, in the format chosen by PlanStoredTable.
+/// @param table The table, the decoder rebuilds the canonical codes from the lengths.
+/// @param output The archive.
+/// @param scratch Memory for the run-length tokens and the code-length code.
+void WriteStoredTable(const HuffmanTable& table, string& output, HuffmanScratch& scratch)
+{
+    StoredTablePlan plan = PlanStoredTable(table, scratch);
+    unsigned codedBytes = plan.codedBytes, storedLengthCodes = plan.storedLengthCodes;
+    if (plan.format == TableFormat::Raw)
+    {
+        output.push_back(static_cast<char>(TableFormat::Raw));
+        for (unsigned length : table.codeLengths)
+            output.push_back(static_cast<char>(length));
+    }
+    else if (plan.format == TableFormat::Sparse)
+    {
+        output.push_back(static_cast<char>(TableFormat::Sparse));
+        output.push_back(static_cast<char>(codedBytes));
+        for (unsigned symbol = 0; symbol < 256; symbol++)
+            if (table.codeLengths[symbol] > 0)
+                output.push_back(static_cast<char>(symbol));
+        BitWriter writer(output);
+        for (unsigned symbol = 0; symbol < table.codeLengths.size(); symbol++)
+            if (table.codeLengths[symbol] > 0 || symbol >= EscapeSymbol)
+                writer.Write(table.codeLengths[symbol], 4);
+        writer.Flush();
+    }
+    else
+    {
+        output.push_back(static_cast<char>(TableFormat::RunLength));
+        BitWriter writer(output);
+        writer.Write(storedLengthCodes - 4, 4);
+        for (unsigned i = 0; i < storedLengthCodes; i++)
+            writer.Write(scratch.lengthTable.codeLengths[LengthCodeOrder[i]], 4); ///< PlanStoredTable only picks RunLength when these fit.
+        for (uint16_t token : scratch.lengthTokens)
+        {
+            unsigned symbol = token & 31;
+            writer.Write(scratch.lengthTable.codes[symbol], scratch.lengthTable.codeLengths[symbol]);
+            if (LengthTokenExtraBits(symbol) > 0)
+                writer.Write(token >> 5, LengthTokenExtraBits(symbol));
+        }
+        writer.Flush();
+    }
+}
+
+/// @brief Builds a table that gives codes only to the K most frequent bytes, the others are coded as escape + 8 raw bits.
+///
+/// Fewer codes mean a smaller stored table, a cheaper tree build and a denser decode table,
+/// which pays off on data with a long tail of rare bytes.
+/// @param histogram Byte frequencies of the block.
+/// @param topK Number of bytes that keep their own code (ties go to the smaller byte).
+/// @param table Receives the table.
+/// @param scratch Memory for the ranking and the tree.
+void BuildTopKTable(const pmr::vector<unsigned>& histogram, unsigned topK, HuffmanTable& table, HuffmanScratch& scratch)
+{
+    scratch.symbolOrder.clear();
+    for (unsigned symbol = 0; symbol < 256; symbol++)
+        if (histogram[symbol] > 0)
+            scratch.symbolOrder.push_back(symbol);
+    sort(scratch.symbolOrder.begin(), scratch.symbolOrder.end(), [&](unsigned a, unsigned b) {
+        return histogram[a] != histogram[b] ? histogram[a] > histogram[b] : a < b;
+    });
+
+    scratch.escapeHistogram.assign(BlockAlphabetSize, 0);
+    for (size_t rank = 0; rank < scratch.symbolOrder.size(); rank++)
+    {
+        unsigned symbol = scratch.symbolOrder[rank];
+        scratch.escapeHistogram[rank < topK ? symbol : EscapeSymbol] += histogram[symbol];
+    }
+    BuildHuffmanTable(scratch.escapeHistogram, table, scratch);
+}
+
+/// @brief Exact size in bits of a static block: stored table plus coded bytes, escapes included.
+uint64_t StaticBlockBits(const pmr::vector<unsigned>& histogram, const HuffmanTable& table, HuffmanScratch& scratch)
+{
+    uint64_t bits = 8 * PlanStoredTable(table, scratch).size;
+    for (unsigned symbol = 0; symbol < 256; symbol++)
+        if (histogram[symbol] > 0)
+            bits += uint64_t(histogram[symbol]) * (table.codeLengths[symbol] > 0 ? table.codeLengths[symbol] : table.codeLengths[EscapeSymbol] + 8);
+    return bits;
+}
+
+/// @brief Builds the static table of a block, optionally capped to the top-K bytes.
+///
+/// With AutoTopK the candidates are "escape every byte seen at most t times" for a few small t
+/// (escaping a frequent byte while keeping a rarer one never helps), each sized exactly with
+/// StaticBlockBits; the cheapest wins, including K = all bytes.
+/// @param histogram Byte frequencies of the block.
+/// @param topK 0, a fixed K or AutoTopK.
+/// @param table Receives the table.
+/// @param scratch Memory for the candidates.
+void BuildStaticTable(const pmr::vector<unsigned>& histogram, unsigned topK, HuffmanTable& table, HuffmanScratch& scratch)
+{
+    if (topK == 0)
+    {
+        BuildHuffmanTable(histogram, table, scratch);
+        return;
+    }
+    if (topK != AutoTopK)
+    {
+        BuildTopKTable(histogram, topK, table, scratch);
+        return;
+    }
+
+    static const unsigned thresholds[] = { 0, 1, 2, 3, 4, 6, 8, 12, 16, 24, 32 };
+    unsigned bestK = 0, previousK = ~0u;
+    uint64_t bestBits = UINT64_MAX;
+    for (unsigned threshold : thresholds)
+    {
+        unsigned candidateK = 0;
+        for (unsigned symbol = 0; symbol < 256; symbol++)
+            candidateK += histogram[symbol] > threshold;
+        if (candidateK == previousK)
+            continue;
+        previousK = candidateK;
+        BuildTopKTable(histogram, candidateK, table, scratch);
+        uint64_t bits = StaticBlockBits(histogram, table, scratch);
+        if (bits < bestBits)
+        {
+            bestBits = bits;
+            bestK = candidateK;
+        }
+    }
+    BuildTopKTable(histogram, bestK, table, scratch);
+}
+
+/// @brief Reads the run-length coded code lengths of a RunLength table.
+/// @param payload Start of the bit stream, after the format byte.
+/// @param payloadSize Bytes available for the bit stream.
+/// @param alphabetSize Number of code lengths to read.
+/// @param table Receives the code lengths.
+/// @param scratch Memory for the code-length code.
+/// @returns Number of bytes taken by the bit stream.
+size_t ReadRunLengthTable(const char* payload, size_t payloadSize, size_t alphabetSize, HuffmanTable& table, HuffmanScratch& scratch)
+{
+    BitReader reader(payload, payloadSize);
+    unsigned storedLengthCodes = static_cast<unsigned>(reader.Read(4)) + 4;
+    if (storedLengthCodes > LengthCodeSymbols)
+        throw runtime_error("Invalid code-length code in block archive.");
+    scratch.lengthTable.codeLengths.assign(LengthCodeSymbols, 0);
+    for (unsigned i = 0; i < storedLengthCodes; i++)
+        scratch.lengthTable.codeLengths[LengthCodeOrder[i]] = static_cast<unsigned>(reader.Read(4));
+    AssignCanonicalCodes(scratch.lengthTable);
+    BuildHuffmanDecoder(scratch.lengthTable, scratch.lengthDecoder);
+    if (scratch.lengthDecoder.sortedSymbols.empty())
+        throw runtime_error("Invalid code-length code in block archive.");
+
+    table.codeLengths.clear();
+    while (table.codeLengths.size() < alphabetSize)
+    {
+        unsigned symbol = DecodeSymbol(scratch.lengthDecoder, reader);
+        unsigned repeat = 1, length = symbol;
+        if (symbol == 16)
+        {
+            if (table.codeLengths.empty())
+                throw runtime_error("Invalid code-length repeat in block archive.");
+            repeat = 3 + static_cast<unsigned>(reader.Read(2));
+            length = table.codeLengths.back();
+        }
+        else if (symbol == 17 || symbol == 18)
+        {
+            repeat = symbol == 17 ? 3 + static_cast<unsigned>(reader.Read(3)) : 11 + static_cast<unsigned>(reader.Read(7));
+            length = 0;
+        }
+        if (table.codeLengths.size() + repeat > alphabetSize)
+            throw runtime_error("Invalid code-length repeat in block archive.");
+        table.codeLengths.insert(table.codeLengths.end(), repeat, length);
+    }
+    size_t bitsUsed = reader.position * 8 - reader.count;
+    if (bitsUsed > payloadSize * 8)
+        throw runtime_error("Truncated Huffman table in block archive.");
+    return (bitsUsed + 7) / 8;
+}
+
+/// @brief Reads code lengths stored in one TableFormat and assigns the canonical codes.
+/// @param format Format of the stored lengths.
+/// @param payload Start of the stored lengths, after the format byte.
+/// @param payloadSize Bytes available for the stored lengths.
+/// @param alphabetSize Number of symbols, byte symbols and the escape first, then any extra symbols.
+/// @param table Receives the code lengths and canonical codes.
+/// @param scratch Memory for the code-length code.
+/// @returns Number of bytes taken by the stored lengths.
+size_t ReadCodeLengths(TableFormat format, const char* payload, size_t payloadSize, size_t alphabetSize, HuffmanTable& table, HuffmanScratch& scratch)
+{
+    size_t used = 0;
+    if (format == TableFormat::Raw)
+    {
+        if (payloadSize < alphabetSize)
+            throw runtime_error("Truncated Huffman table in block archive.");
+        table.codeLengths.resize(alphabetSize);
+        for (unsigned symbol = 0; symbol < alphabetSize; symbol++)
+            table.codeLengths[symbol] = static_cast<unsigned char>(payload[symbol]);
+        used = alphabetSize;
+    }
+    else if (format == TableFormat::Sparse)
+    {
+        size_t codedBytes = payloadSize > used ? static_cast<unsigned char>(payload[used++]) : SIZE_MAX;
+        size_t nibbleBytes = (codedBytes + alphabetSize - EscapeSymbol + 1) / 2;
+        if (codedBytes == SIZE_MAX || payloadSize < used + codedBytes + nibbleBytes)
+            throw runtime_error("Truncated Huffman table in block archive.");
+        BitReader reader(payload + used + codedBytes, nibbleBytes);
+        table.codeLengths.assign(alphabetSize, 0);
+        for (size_t i = 0; i < codedBytes; i++)
+        {
+            unsigned symbol = static_cast<unsigned char>(payload[used + i]);
+            if (i > 0 && symbol <= static_cast<unsigned char>(payload[used + i - 1]))
+                throw runtime_error("Invalid sparse Huffman table in block archive.");
+            table.codeLengths[symbol] = static_cast<unsigned>(reader.Read(4));
+        }
+        for (size_t symbol = EscapeSymbol; symbol < alphabetSize; symbol++)
+            table.codeLengths[symbol] = static_cast<unsigned>(reader.Read(4));
+        used += codedBytes + nibbleBytes;
+    }
+    else if (format == TableFormat::RunLength)
+        used = ReadRunLengthTable(payload, payloadSize, alphabetSize, table, scratch);
+    else
+        throw runtime_error("Unknown Huffman table format in block archive.");
+    AssignCanonicalCodes(table);
+    return used;
+}
+
+/// @brief Reads a table written by WriteStoredTable: the format byte, then the lengths.
+/// @param payload Start of the stored table.
+/// @param payloadSize Bytes available for the stored table.
+/// @param alphabetSize Number of symbols of the table.
+/// @param table Receives the code lengths and canonical codes.
+/// @param scratch Memory for the code-length code.
+/// @returns Number of bytes taken by the table.
+size_t ReadStoredTable(const char* payload, size_t payloadSize, size_t alphabetSize, HuffmanTable& table, HuffmanScratch& scratch)
+{
+    if (payloadSize < 1)
+        throw runtime_error("Truncated Huffman table in block archive.");
+    return 1 + ReadCodeLengths(static_cast<TableFormat>(payload[0]), payload + 1, payloadSize - 1, alphabetSize, table, scratch);
+}
+
+/// @brief Reads the table stored in front of a block payload.
+/// @param mode Mode of the block, Huffman blocks store raw lengths, PackedHuffman blocks a TableFormat,
+/// PairHuffman blocks their pair list and then a TableFormat.
+/// @param payload Start of the block payload.
+/// @param payloadSize Length of the block payload.
+/// @param table Receives the code lengths, canonical codes and pairs.
+/// @param scratch Memory for the code-length code.
+/// @returns Number of payload bytes taken by the table.
+size_t ReadStoredTable(BlockMode mode, const char* payload, size_t payloadSize, HuffmanTable& table, HuffmanScratch& scratch)
+{
+    size_t used = 0;
+    table.pairs.clear();
+    if (mode == BlockMode::PairHuffman)
+    {
+        size_t pairCount = payloadSize > used ? static_cast<unsigned char>(payload[used++]) : SIZE_MAX;
+        if (pairCount == SIZE_MAX || payloadSize < used + 2 * pairCount)
+            throw runtime_error("Truncated pair list in block archive.");
+        for (size_t i = 0; i < pairCount; i++, used += 2)
+            table.pairs.push_back(static_cast<uint16_t>((static_cast<unsigned char>(payload[used]) << 8) | static_cast<unsigned char>(payload[used + 1])));
+    }
+    size_t alphabetSize = BlockAlphabetSize + table.pairs.size();
+    if (mode == BlockMode::PackedHuffman || mode == BlockMode::PairHuffman)
+        return used + ReadStoredTable(payload + used, payloadSize - used, alphabetSize, table, scratch);
+    return used + ReadCodeLengths(TableFormat::Raw, payload + used, payloadSize - used, alphabetSize, table, scratch);
+}
+
+/// @brief Bytes of the sample the pre-screen takes from each of PrescreenWindows places in a block.
+const size_t PrescreenWindowSize = 1024;
+
+/// @brief Number of places the pre-screen samples in a block.
+const size_t PrescreenWindows = 4;
+
+/// @brief Sampled order-0 entropy (bits per byte) above which a block is stored raw.
+///
+/// Order-0 Huffman coding cannot save more than 8 minus the entropy bits per byte, which
+/// above this threshold no longer pays for the table and the coding time.
+const double IncompressibleEntropy = 7.9;
+
+/// @brief Sampled entropy above which a block that starts with a compressed format's signature is stored raw.
+///
+/// Headers and stored tables at the start of compressed files pull the sample slightly below
+/// IncompressibleEntropy. Text that merely starts like a signature, or an archive whose
+/// sections still code well, stays below this and is coded as usual.
+const double MagicEntropy = 7.7;
+
+/// @brief Checks whether a block starts with the signature of an already compressed format.
+///
+/// Covers gzip, zip, bzip2, xz, zstd, 7z, JPEG, PNG, GIF and this program's own archives,
+/// with the longest fixed prefix of each so plain text rarely matches.
+bool HasCompressedMagic(const pmr::vector<ByteSpan>& pieces)
+{
+    unsigned char head[10] = {};
+    size_t length = 0;
+    for (const ByteSpan& piece : pieces)
+        for (size_t i = 0; i < piece.size && length < sizeof(head); i++)
+            head[length++] = static_cast<unsigned char>(piece.data[i]);
+
+    if (length >= 10 && memcmp(head, "BZh", 3) == 0 && head[3] >= '1' && head[3] <= '9' && memcmp(head + 4, "1AY&SY", 6) == 0)
+        return true; ///< bzip2: block size digit, then the block magic (pi).
+    static const pair<const char*, size_t> signatures[] = {
+        { "\x1F\x8B\x08", 3 }, { "PK\x03\x04", 4 }, { "\xFD" "7zXZ\x00", 6 }, { "\x28\xB5\x2F\xFD", 4 },
+        { "7z\xBC\xAF\x27\x1C", 6 }, { "\xFF\xD8\xFF", 3 }, { "\x89PNG\r\n\x1A\n", 8 }, { "GIF87a", 6 }, { "GIF89a", 6 },
+        { "HFB1", 4 }, { "HBT1", 4 }, { "HTK1", 4 }, { "HTD1", 4 }, { "HWS1", 4 }, { "HCV1", 4 }, { "HLT1", 4 }
+    };
+    for (const auto& signature : signatures)
+        if (length >= signature.second && memcmp(head, signature.first, signature.second) == 0)
+            return true;
+    return false;
+}
+
+/// @brief Order-0 entropy of a byte sample in bits per byte, with the Miller-Madow correction.
+/// @param counts Frequency of every byte in the sample.
+/// @param sampled Number of bytes in the sample.
+double SampleEntropy(const unsigned* counts, uint64_t sampled)
+{
+    double entropy = 0;
+    unsigned distinct = 0;
+    for (unsigned byte = 0; byte < 256; byte++)
+        if (counts[byte] > 0)
+        {
+            double probability = double(counts[byte]) / sampled;
+            entropy -= probability * log2(probability);
+            distinct++;
+        }
+    return sampled > 0 ? entropy + (distinct - 1) / (2.0 * sampled * log(2.0)) : 0;
+}
+
+/// @brief Estimates the order-0 entropy of a block from a few sampled windows.
+///
+/// Uses the Miller-Madow correction, so small samples of random data are not mistaken for compressible.
+/// @param pieces The ranges of the block.
+/// @param size Length of the block.
+/// @returns Estimated bits per byte.
+double SampledEntropy(const pmr::vector<ByteSpan>& pieces, uint64_t size)
+{
+    unsigned counts[256] = {};
+    uint64_t sampled = 0;
+    size_t windows = size <= PrescreenWindowSize * PrescreenWindows ? 1 : PrescreenWindows;
+    uint64_t windowSize = windows == 1 ? size : PrescreenWindowSize;
+    for (size_t window = 0; window < windows; window++)
+    {
+        uint64_t start = windows == 1 ? 0 : window * (size - windowSize) / (windows - 1); ///< Spread from the first to the last byte.
+        uint64_t pieceStart = 0;
+        for (const ByteSpan& piece : pieces)
+        {
+            uint64_t first = max(start, pieceStart), last = min(start + windowSize, pieceStart + piece.size);
+            for (uint64_t i = first; i < last; i++)
+                counts[static_cast<unsigned char>(piece.data[i - pieceStart])]++;
+            pieceStart += piece.size;
+        }
+        sampled += windowSize;
+    }
+    return SampleEntropy(counts, sampled);
+}
+
+/// @brief Decides cheaply whether a block should be stored raw instead of coded.
+/// @param pieces The ranges of the block.
+/// @param size Length of the block.
+/// @param startOfInput True for the first block of an input, the only one checked for magic bytes.
+bool LooksIncompressible(const pmr::vector<ByteSpan>& pieces, uint64_t size, bool startOfInput)
+{
+    double entropy = SampledEntropy(pieces, size);
+    return entropy > IncompressibleEntropy || (startOfInput && entropy > MagicEntropy && HasCompressedMagic(pieces));
+}
+
+/// @brief Appends a Raw block holding the bytes of the pieces.
+void AppendRawBlock(const pmr::vector<ByteSpan>& pieces, size_t size, string& output)
+{
+    output.push_back(static_cast<char>(BlockMode::Raw));
+    AppendUint32(output, static_cast<uint32_t>(size));
+    AppendUint32(output, static_cast<uint32_t>(size));
+    for (const ByteSpan& piece : pieces)
+        output.append(piece.data, piece.size);
+}
+
+/// @brief Filters one element, T is the unsigned type of the element width.
+template <typename T>
+T FilterValue(FilterKind kind, T value, T previous)
+{
+    using Signed = make_signed_t<T>;
+    T delta = static_cast<T>(value - previous);
+    T source = kind == FilterKind::Zigzag ? value : delta;
+    T zigzag = static_cast<T>(static_cast<T>(source << 1) ^ static_cast<T>(static_cast<Signed>(source) >> (8 * sizeof(T) - 1)));
+    return kind == FilterKind::Delta ? delta : kind == FilterKind::Xor ? static_cast<T>(value ^ previous) : zigzag;
+}
+
+/// @brief Reverses FilterValue given the already restored previous element.
+template <typename T>
+T UnfilterValue(FilterKind kind, T value, T previous)
+{
+    T unzigzag = static_cast<T>((value >> 1) ^ static_cast<T>(0 - (value & 1)));
+    switch (kind)
+    {
+    case FilterKind::Delta: return static_cast<T>(value + previous);
+    case FilterKind::Xor: return static_cast<T>(value ^ previous);
+    case FilterKind::Zigzag: return unzigzag;
+    default: return static_cast<T>(unzigzag + previous);
+    }
+}
+
+#ifdef __SSE2__
+/// @brief Lane-wise addition of Width byte lanes.
+template <unsigned Width>
+__m128i AddLanes(__m128i a, __m128i b)
+{
+    if constexpr (Width == 1) return _mm_add_epi8(a, b);
+    else if constexpr (Width == 2) return _mm_add_epi16(a, b);
+    else if constexpr (Width == 4) return _mm_add_epi32(a, b);
+    else return _mm_add_epi64(a, b);
+}
+
+/// @brief Lane-wise subtraction of Width byte lanes.
+template <unsigned Width>
+__m128i SubtractLanes(__m128i a, __m128i b)
+{
+    if constexpr (Width == 1) return _mm_sub_epi8(a, b);
+    else if constexpr (Width == 2) return _mm_sub_epi16(a, b);
+    else if constexpr (Width == 4) return _mm_sub_epi32(a, b);
+    else return _mm_sub_epi64(a, b);
+}
+
+/// @brief All ones in the lanes whose sign bit is set.
+template <unsigned Width>
+__m128i SignLanes(__m128i a)
+{
+    if constexpr (Width == 1) return _mm_cmpgt_epi8(_mm_setzero_si128(), a);
+    else if constexpr (Width == 2) return _mm_srai_epi16(a, 15);
+    else if constexpr (Width == 4) return _mm_srai_epi32(a, 31);
+    else return _mm_shuffle_epi32(_mm_srai_epi32(a, 31), _MM_SHUFFLE(3, 3, 1, 1));
+}
+
+/// @brief Lane-wise zigzag mapping, (a << 1) ^ (a >> bits - 1).
+template <unsigned Width>
+__m128i ZigzagLanes(__m128i a)
+{
+    return _mm_xor_si128(AddLanes<Width>(a, a), SignLanes<Width>(a));
+}
+
+/// @brief Lane-wise inverse of ZigzagLanes, (a >> 1) ^ -(a & 1).
+template <unsigned Width>
+__m128i UnzigzagLanes(__m128i a)
+{
+    __m128i half;
+    if constexpr (Width == 1) half = _mm_and_si128(_mm_srli_epi16(a, 1), _mm_set1_epi8(0x7F));
+    else if constexpr (Width == 2) half = _mm_srli_epi16(a, 1);
+    else if constexpr (Width == 4) half = _mm_srli_epi32(a, 1);
+    else half = _mm_srli_epi64(a, 1);
+    __m128i one = Width == 1 ? _mm_set1_epi8(1) : Width == 2 ? _mm_set1_epi16(1) : Width == 4 ? _mm_set1_epi32(1) : _mm_set1_epi64x(1);
+    return _mm_xor_si128(half, SubtractLanes<Width>(_mm_setzero_si128(), _mm_and_si128(a, one)));
+}
+
+/// @brief Inclusive prefix of an associative lane operation within one vector (log-step shifts).
+template <unsigned Width, typename Operation>
+__m128i PrefixLanes(__m128i a, Operation operation)
+{
+    if constexpr (Width == 1) a = operation(a, _mm_slli_si128(a, 1));
+    if constexpr (Width <= 2) a = operation(a, _mm_slli_si128(a, 2));
+    if constexpr (Width <= 4) a = operation(a, _mm_slli_si128(a, 4));
+    return operation(a, _mm_slli_si128(a, 8));
+}
+
+/// @brief Copies the last lane into every lane.
+template <unsigned Width>
+__m128i BroadcastLastLane(__m128i a)
+{
+    if constexpr (Width == 1) a = _mm_unpackhi_epi8(a, a);
+    if constexpr (Width <= 2) a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+    if constexpr (Width <= 4) return _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 3, 3, 3));
+    else return _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 2, 3, 2));
+}
+#endif
+
+/// @brief Filters count elements of type T.
+///
+/// Elements are read in host byte order, which is little-endian on every supported target.
+/// With SSE2 each element only depends on the input, so 16 bytes are filtered per step.
+template <typename T>
+void FilterElements(FilterKind kind, const char* input, size_t count, char* output)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    constexpr unsigned Width = sizeof(T);
+    if (count > 0)
+    {
+        T first;
+        memcpy(&first, input, sizeof(T));
+        first = FilterValue<T>(kind, first, 0);
+        memcpy(output, &first, sizeof(T));
+        for (i = 1; i + 16 / Width <= count; i += 16 / Width)
+        {
+            __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i * Width));
+            __m128i previous = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + (i - 1) * Width));
+            __m128i result;
+            if (kind == FilterKind::Delta)
+                result = SubtractLanes<Width>(value, previous);
+            else if (kind == FilterKind::Xor)
+                result = _mm_xor_si128(value, previous);
+            else if (kind == FilterKind::Zigzag)
+                result = ZigzagLanes<Width>(value);
+            else
+                result = ZigzagLanes<Width>(SubtractLanes<Width>(value, previous));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(output + i * Width), result);
+        }
+    }
+#endif
+    for (; i < count; i++)
+    {
+        T value, previous = 0;
+        memcpy(&value, input + i * sizeof(T), sizeof(T));
+        if (i > 0)
+            memcpy(&previous, input + (i - 1) * sizeof(T), sizeof(T));
+        value = FilterValue<T>(kind, value, previous);
+        memcpy(output + i * sizeof(T), &value, sizeof(T));
+    }
+}
+
+/// @brief Reverses FilterElements in place.
+///
+/// Delta and XOR are prefix sums; with SSE2 each vector is summed in log-steps and the last
+/// element of the previous vector is added to all its lanes.
+template <typename T>
+void UnfilterElements(FilterKind kind, char* data, size_t count)
+{
+    T previous = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    constexpr unsigned Width = sizeof(T);
+    __m128i carry = _mm_setzero_si128();
+    for (; i + 16 / Width <= count; i += 16 / Width)
+    {
+        __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i * Width));
+        if (kind == FilterKind::Zigzag || kind == FilterKind::ZigzagDelta)
+            value = UnzigzagLanes<Width>(value);
+        if (kind == FilterKind::Xor)
+            value = _mm_xor_si128(PrefixLanes<Width>(value, [](__m128i a, __m128i b) { return _mm_xor_si128(a, b); }), carry);
+        else if (kind != FilterKind::Zigzag)
+            value = AddLanes<Width>(PrefixLanes<Width>(value, [](__m128i a, __m128i b) { return AddLanes<Width>(a, b); }), carry);
+        carry = BroadcastLastLane<Width>(value);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(data + i * Width), value);
+    }
+    if (i > 0)
+        memcpy(&previous, data + (i - 1) * Width, Width);
+#endif
+    for (; i < count; i++)
+    {
+        T value;
+        memcpy(&value, data + i * sizeof(T), sizeof(T));
+        previous = UnfilterValue<T>(kind, value, previous);
+        memcpy(data + i * sizeof(T), &previous, sizeof(T));
+    }
+}
+
+/// @brief Applies a filter byte to a block.
+/// @param filter A valid filter byte.
+/// @param input The block.
+/// @param size Length of the block.
+/// @param output Receives size filtered bytes.
+void ApplyFilter(uint8_t filter, const char* input, size_t size, char* output)
+{
+    FilterKind kind = static_cast<FilterKind>(filter >> 4);
+    unsigned width = filter & 15;
+    size_t count = size / width;
+    if (width == 1)
+        FilterElements<uint8_t>(kind, input, count, output);
+    else if (width == 2)
+        FilterElements<uint16_t>(kind, input, count, output);
+    else if (width == 4)
+        FilterElements<uint32_t>(kind, input, count, output);
+    else
+        FilterElements<uint64_t>(kind, input, count, output);
+    memcpy(output + count * width, input + count * width, size - count * width);
+}
+
+/// @brief Reverses ApplyFilter in place.
+void RemoveFilter(uint8_t filter, char* data, size_t size)
+{
+    FilterKind kind = static_cast<FilterKind>(filter >> 4);
+    unsigned width = filter & 15;
+    if (width == 1)
+        UnfilterElements<uint8_t>(kind, data, size);
+    else if (width == 2)
+        UnfilterElements<uint16_t>(kind, data, size / 2);
+    else if (width == 4)
+        UnfilterElements<uint32_t>(kind, data, size / 4);
+    else
+        UnfilterElements<uint64_t>(kind, data, size / 8);
+}
+
+/// @brief Picks the filter whose output has the lowest order-0 entropy on a few sampled windows.
+///
+/// Tries every kind at widths 1, 2, 4 and 8 on the same windows the pre-screen samples; a filter
+/// must save at least MinFilterGain bits per byte over the unfiltered bytes to be chosen.
+/// @param data The block.
+/// @param size Length of the block.
+/// @param sample Memory for one filtered window.
+/// @returns The filter byte, 0 for none.
+uint8_t ChooseFilter(const char* data, size_t size, pmr::vector<char>& sample)
+{
+    const double MinFilterGain = 0.25;
+    size_t windows = size <= PrescreenWindowSize * PrescreenWindows ? 1 : PrescreenWindows;
+    size_t windowSize = windows == 1 ? size : PrescreenWindowSize;
+    sample.resize(windowSize);
+    auto entropyOf = [&](uint8_t filter) {
+        unsigned counts[256] = {};
+        for (size_t window = 0; window < windows; window++)
+        {
+            size_t start = windows == 1 ? 0 : (window * (size - windowSize) / (windows - 1)) & ~size_t(7); ///< Aligned for every width.
+            const char* bytes = data + start;
+            if (filter != 0)
+            {
+                ApplyFilter(filter, bytes, windowSize, sample.data()); ///< The first element of a window is filtered against 0.
+                bytes = sample.data();
+            }
+            for (size_t i = 0; i < windowSize; i++)
+                counts[static_cast<unsigned char>(bytes[i])]++;
+        }
+        return SampleEntropy(counts, uint64_t(windows) * windowSize);
+    };
+
+    uint8_t best = 0;
+    double bestEntropy = entropyOf(0) - MinFilterGain;
+    for (unsigned kind = 1; kind <= 4; kind++)
+        for (unsigned width = 1; width <= 8; width *= 2)
+        {
+            uint8_t filter = MakeFilter(static_cast<FilterKind>(kind), width);
+            double entropy = entropyOf(filter);
+            if (entropy < bestEntropy)
+            {
+                bestEntropy = entropy;
+                best = filter;
+            }
+        }
+    return best;
+}
+
+/// @brief Number of bytes of a plane, the last plane also holds the bytes that do not fill a record.
+size_t PlaneSize(size_t size, unsigned planeCount, unsigned plane)
+{
+    return size / planeCount + (plane + 1 == planeCount ? size % planeCount : 0);
+}
+
+#ifdef __SSE2__
+/// @brief Splits Width vectors of Width-byte records into Width vectors of one plane each.
+///
+/// Each round separates even and odd bytes (mask and shift, then pack); log2(Width) rounds
+/// leave plane k in vector k, the byte shuffle of blosc.
+template <unsigned Width>
+void TransposeToPlanes(__m128i (&vectors)[Width])
+{
+    const __m128i low = _mm_set1_epi16(0x00FF);
+    for (unsigned round = 1; round < Width; round *= 2)
+    {
+        __m128i split[Width];
+        for (unsigned i = 0; i < Width / 2; i++)
+        {
+            __m128i a = vectors[2 * i], b = vectors[2 * i + 1];
+            split[i] = _mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low));
+            split[Width / 2 + i] = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+        }
+        for (unsigned i = 0; i < Width; i++)
+            vectors[i] = split[i];
+    }
+}
+
+/// @brief Reverses TransposeToPlanes by interleaving the bytes of plane pairs.
+template <unsigned Width>
+void TransposeFromPlanes(__m128i (&vectors)[Width])
+{
+    for (unsigned round = 1; round < Width; round *= 2)
+    {
+        __m128i merged[Width];
+        for (unsigned i = 0; i < Width / 2; i++)
+        {
+            merged[2 * i] = _mm_unpacklo_epi8(vectors[i], vectors[Width / 2 + i]);
+            merged[2 * i + 1] = _mm_unpackhi_epi8(vectors[i], vectors[Width / 2 + i]);
+        }
+        for (unsigned i = 0; i < Width; i++)
+            vectors[i] = merged[i];
+    }
+}
+
+/// @brief Moves 16 records at a time between record order and plane order.
+/// @returns Number of records handled, the caller does the rest.
+template <unsigned Width>
+size_t TransposeRecords(const char* input, size_t records, size_t planeSize, char* output, bool toPlanes)
+{
+    size_t record = 0;
+    for (; record + 16 <= records; record += 16)
+    {
+        __m128i vectors[Width];
+        for (unsigned i = 0; i < Width; i++)
+            vectors[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(toPlanes ? input + record * Width + 16 * i : input + i * planeSize + record));
+        if (toPlanes)
+            TransposeToPlanes<Width>(vectors);
+        else
+            TransposeFromPlanes<Width>(vectors);
+        for (unsigned i = 0; i < Width; i++)
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(toPlanes ? output + i * planeSize + record : output + record * Width + 16 * i), vectors[i]);
+    }
+    return record;
+}
+#endif
+
+/// @brief Moves whole records between record order and plane order, with SSE2 for 2, 4, 8 and 16 byte records.
+void TransposeAllRecords(const char* input, size_t size, unsigned planeCount, char* output, bool toPlanes)
+{
+    size_t records = size / planeCount, record = 0;
+#ifdef __SSE2__
+    if (planeCount == 2)
+        record = TransposeRecords<2>(input, records, records, output, toPlanes);
+    else if (planeCount == 4)
+        record = TransposeRecords<4>(input, records, records, output, toPlanes);
+    else if (planeCount == 8)
+        record = TransposeRecords<8>(input, records, records, output, toPlanes);
+    else if (planeCount == 16)
+        record = TransposeRecords<16>(input, records, records, output, toPlanes);
+#endif
+    for (; record < records; record++)
+        for (unsigned plane = 0; plane < planeCount; plane++)
+        {
+            size_t recordIndex = record * planeCount + plane, planeIndex = plane * records + record;
+            output[toPlanes ? planeIndex : recordIndex] = input[toPlanes ? recordIndex : planeIndex];
+        }
+    size_t whole = records * planeCount;
+    memcpy(output + whole, input + whole, size - whole); ///< The partial record ends the last plane.
+}
+
+/// @brief Splits a block into planeCount byte planes, plane k holds byte k of every record.
+void SplitPlanes(const char* input, size_t size, unsigned planeCount, char* output)
+{
+    TransposeAllRecords(input, size, planeCount, output, true);
+}
+
+/// @brief Reverses SplitPlanes.
+void MergePlanes(const char* input, size_t size, unsigned planeCount, char* output)
+{
+    TransposeAllRecords(input, size, planeCount, output, false);
+}
+
+/// @brief Picks the record width whose planes have the lowest estimated coded size.
+///
+/// For 1 (no split) and every candidate width, the sampled windows are split into planes and the
+/// order-0 entropy of each plane is added up; every table is charged about a sparse table's size
+/// for the bytes it codes, and a split must save MinPlaneGain of the estimate, since the
+/// smaller per-plane samples make the entropy estimates optimistic.
+/// @param data The block.
+/// @param size Length of the block.
+/// @param counts Memory for the per-plane frequencies.
+/// @returns The width, 1 for none.
+unsigned ChoosePlaneCount(const char* data, size_t size, pmr::vector<unsigned>& counts)
+{
+    const double MinPlaneGain = 0.04;
+    static const unsigned candidates[] = { 1, 2, 3, 4, 6, 8, 12, 16 };
+    size_t windows = size <= PrescreenWindowSize * PrescreenWindows ? 1 : PrescreenWindows;
+    size_t windowSize = windows == 1 ? size : PrescreenWindowSize;
+    unsigned best = 1;
+    double bestBits = 0;
+    for (unsigned planeCount : candidates)
+    {
+        counts.assign(256 * planeCount, 0);
+        for (size_t window = 0; window < windows; window++)
+        {
+            size_t start = windows == 1 ? 0 : window * (size - windowSize) / (windows - 1);
+            start -= start % planeCount; ///< Windows start on a record.
+            for (size_t i = 0; i < windowSize; i++)
+                counts[256 * ((start + i) % planeCount) + static_cast<unsigned char>(data[start + i])]++;
+        }
+        double bits = 0;
+        for (unsigned plane = 0; plane < planeCount; plane++)
+        {
+            uint64_t sampled = 0;
+            unsigned distinct = 0;
+            for (unsigned byte = 0; byte < 256; byte++)
+            {
+                sampled += counts[256 * plane + byte];
+                distinct += counts[256 * plane + byte] > 0;
+            }
+            bits += SampleEntropy(&counts[256 * plane], sampled) * sampled / (double(windows) * windowSize) * size + 8 * (3 + 1.5 * distinct);
+        }
+        if (planeCount == 1 || bits < bestBits * (best == 1 ? 1 - MinPlaneGain : 1))
+        {
+            bestBits = bits;
+            best = planeCount;
+        }
+    }
+    return best;
+}
+
+/// @struct BlockEncoder
+/// @brief Encodes consecutive blocks of one archive.
+///
+/// In lag-one mode block N is coded with the table built from block N-1's histogram,
+/// which is gathered while block N-1 is coded, so every byte is visited only once.
+/// All per-block memory is kept between blocks, so a warmed up encoder does not allocate,
+/// and all of it comes from the memory resource given at construction.
+struct BlockEncoder
+{
+    BlockOptions options; ///< Archive settings.
+    HuffmanTable previousTable; ///< Lag-one table built from the previous block.
+    size_t nextBlockSize; ///< Size of the next block, ramps up in lag-one mode.
+    HuffmanTable table; ///< Table of the current static block.
+    HuffmanScratch scratch; ///< Tree memory for building tables.
+    pmr::vector<unsigned> histogram; ///< Byte frequencies of the current block.
+    pmr::vector<ByteSpan> singlePiece; ///< Piece list for contiguous blocks.
+    bool atStartOfInput = true; ///< The next block is the first of its input, the pre-screen checks its magic bytes.
+    pmr::vector<unsigned> pairCounts; ///< Frequencies of all byte pairs of the current block (--pairs).
+    pmr::vector<unsigned> pairOrder; ///< Candidate pairs by decreasing frequency.
+    pmr::vector<uint16_t> pairSymbols; ///< Symbol of every selected pair, 0 for the others.
+    pmr::vector<unsigned> pairHistogram; ///< Frequencies of the byte and pair symbols of the current block.
+    HuffmanTable pairTable; ///< Table over bytes and pairs.
+    pmr::vector<char> joined; ///< The block joined into one range when it has several pieces and a filter or planes apply.
+    pmr::vector<char> filterSample; ///< One filtered window while a filter is picked.
+    pmr::vector<char> filtered; ///< The filtered block.
+    pmr::vector<ByteSpan> filteredPiece; ///< Piece list of the filtered block.
+    pmr::vector<unsigned> planeCounts; ///< Sampled byte frequencies of every plane while a plane count is picked.
+    pmr::vector<char> planeBuffer; ///< The block split into byte planes.
+    pmr::vector<ByteSpan> planePiece; ///< Piece list of the current plane.
+
+    explicit BlockEncoder(const BlockOptions& options, pmr::memory_resource* resource = pmr::get_default_resource())
+        : previousTable(resource), table(resource), scratch(resource), histogram(resource), singlePiece(resource),
+        pairCounts(resource), pairOrder(resource), pairSymbols(resource), pairHistogram(resource), pairTable(resource),
+        joined(resource), filterSample(resource), filtered(resource), filteredPiece(resource), planeCounts(resource), planeBuffer(resource),
+        planePiece(resource)
+    {
+        Reset(options);
+    }
+
+    /// @brief Starts a new archive, keeping the memory of the previous one.
+    void Reset(const BlockOptions& newOptions)
+    {
+        options = newOptions;
+        atStartOfInput = true;
+        histogram.assign(BlockAlphabetSize, 0);
+        BuildLagOneTable(histogram, previousTable, scratch);
+        nextBlockSize = options.lagOne ? min<size_t>(1024, options.blockSize) : options.blockSize; ///< The first lag-one block has no statistics, keep it short.
+    }
+
+    /// @brief Returns the size of the next block and advances the lag-one ramp.
+    size_t TakeBlockSize()
+    {
+        size_t size = nextBlockSize;
+        nextBlockSize = min(nextBlockSize * 2, options.blockSize); ///< Doubles until the configured block size is reached.
+        return size;
+    }
+
+    /// @brief Builds the lag-one table, the escape symbol always keeps a code.
+    /// @param histogram Byte frequencies of the previous block, the escape count is overwritten.
+    /// @param table Receives the table.
+    /// @param scratch Tree memory.
+    static void BuildLagOneTable(pmr::vector<unsigned>& histogram, HuffmanTable& table, HuffmanScratch& scratch)
+    {
+        histogram[EscapeSymbol] = 1;
+        BuildHuffmanTable(histogram, table, scratch);
+    }
+
+    /// @brief Builds pairTable for a block dominated by one byte and checks that it beats the static table.
+    ///
+    /// When one byte takes more than half of a block, order-0 codes spend close to a whole bit on
+    /// it although it carries far less information. Coding the most frequent byte pairs as
+    /// symbols of their own (up to MaxPairSymbols, each seen at least MinPairCount times) halves
+    /// that waste, and the decoder emits two bytes per lookup. Pairs the greedy parse never takes
+    /// are dropped, then both blocks are sized exactly.
+    /// @param pieces The ranges of the block.
+    /// @param size Length of the block.
+    /// @returns True if the PairHuffman block is smaller, pairSymbols is then left set for coding.
+    bool BuildPairTable(const pmr::vector<ByteSpan>& pieces, size_t size)
+    {
+        if (2 * uint64_t(*max_element(histogram.begin(), histogram.begin() + 256)) <= size)
+            return false;
+        pairCounts.assign(size_t(1) << 16, 0);
+        unsigned previous = 256;
+        for (const ByteSpan& piece : pieces)
+            for (size_t i = 0; i < piece.size; i++)
+            {
+                unsigned byte = static_cast<unsigned char>(piece.data[i]);
+                if (previous < 256)
+                    pairCounts[(previous << 8) | byte]++;
+                previous = byte;
+            }
+        pairOrder.clear();
+        for (unsigned pair = 0; pair < pairCounts.size(); pair++)
+            if (pairCounts[pair] >= MinPairCount)
+                pairOrder.push_back(pair);
+        size_t candidates = min<size_t>(pairOrder.size(), MaxPairSymbols);
+        if (candidates == 0)
+            return false;
+        partial_sort(pairOrder.begin(), pairOrder.begin() + candidates, pairOrder.end(), [&](unsigned a, unsigned b) {
+            return pairCounts[a] != pairCounts[b] ? pairCounts[a] > pairCounts[b] : a < b;
+        });
+
+        pairSymbols.resize(size_t(1) << 16, 0);
+        for (size_t i = 0; i < candidates; i++)
+            pairSymbols[pairOrder[i]] = static_cast<uint16_t>(BlockAlphabetSize + i);
+        pairHistogram.assign(BlockAlphabetSize + candidates, 0);
+        ForEachPairSymbol(pieces, pairSymbols, [&](unsigned symbol) { pairHistogram[symbol]++; });
+        pairTable.pairs.clear();
+        for (size_t i = 0; i < candidates; i++)
+        {
+            unsigned pair = pairOrder[i], count = pairHistogram[BlockAlphabetSize + i];
+            pairSymbols[pair] = 0; ///< Dropping a pair the parse never took does not change the parse.
+            if (count == 0)
+                continue;
+            pairSymbols[pair] = static_cast<uint16_t>(BlockAlphabetSize + pairTable.pairs.size());
+            pairHistogram[pairSymbols[pair]] = count;
+            pairTable.pairs.push_back(static_cast<uint16_t>(pair));
+        }
+        pairHistogram.resize(BlockAlphabetSize + pairTable.pairs.size());
+        BuildHuffmanTable(pairHistogram, pairTable, scratch);
+
+        uint64_t pairBits = 8 * (1 + 2 * pairTable.pairs.size() + PlanStoredTable(pairTable, scratch).size);
+        for (unsigned symbol = 0; symbol < pairHistogram.size(); symbol++)
+            pairBits += uint64_t(pairHistogram[symbol]) * pairTable.codeLengths[symbol];
+        if (!pairTable.pairs.empty() && pairBits < StaticBlockBits(histogram, table, scratch))
+            return true;
+        for (uint16_t pair : pairTable.pairs)
+            pairSymbols[pair] = 0;
+        return false;
+    }
+
+    /// @brief Appends one block (header and payload) to the archive.
+    /// @param data Start of the block.
+    /// @param size Length of the block.
+    /// @param output The archive.
+    void EncodeBlock(const char* data, size_t size, string& output)
+    {
+        singlePiece.assign(1, ByteSpan{ data, size });
+        EncodeBlock(singlePiece, output);
+    }
+
+    /// @brief Appends the table and bits of a static block, as a PairHuffman payload if --pairs makes it smaller.
+    /// @param pieces The ranges to code.
+    /// @param size Length of the ranges.
+    /// @param output The archive.
+    /// @returns The mode of the payload, PackedHuffman or PairHuffman.
+    BlockMode AppendStaticPayload(const pmr::vector<ByteSpan>& pieces, size_t size, string& output)
+    {
+        BitWriter writer(output);
+        CountSymbols(pieces, histogram);
+        BuildStaticTable(histogram, options.topK, table, scratch);
+        if (options.pairs && BuildPairTable(pieces, size))
+        {
+            output.push_back(static_cast<char>(pairTable.pairs.size()));
+            for (uint16_t pair : pairTable.pairs)
+            {
+                output.push_back(static_cast<char>(pair >> 8));
+                output.push_back(static_cast<char>(pair));
+            }
+            WriteStoredTable(pairTable, output, scratch);
+            ForEachPairSymbol(pieces, pairSymbols, [&](unsigned symbol) { writer.Write(pairTable.codes[symbol], pairTable.codeLengths[symbol]); });
+            for (uint16_t pair : pairTable.pairs)
+                pairSymbols[pair] = 0;
+            writer.Flush();
+            return BlockMode::PairHuffman;
+        }
+        WriteStoredTable(table, output, scratch);
+        EncodeSymbols(pieces, table, writer, histogram);
+        writer.Flush();
+        return BlockMode::PackedHuffman;
+    }
+
+    /// @brief Appends a Planes payload: the plane count, then every byte plane as a nested static or Raw block.
+    /// @param data The block.
+    /// @param size Length of the block.
+    /// @param planeCount Record width, at least 2.
+    /// @param output The archive.
+    void AppendPlanesPayload(const char* data, size_t size, unsigned planeCount, string& output)
+    {
+        planeBuffer.resize(size);
+        SplitPlanes(data, size, planeCount, planeBuffer.data());
+        output.push_back(static_cast<char>(planeCount));
+        size_t offset = 0;
+        for (unsigned plane = 0; plane < planeCount; plane++)
+        {
+            size_t planeSize = PlaneSize(size, planeCount, plane);
+            planePiece.assign(1, ByteSpan{ planeBuffer.data() + offset, planeSize });
+            offset += planeSize;
+            size_t headerOffset = output.size();
+            output.push_back(static_cast<char>(BlockMode::PackedHuffman));
+            AppendUint32(output, static_cast<uint32_t>(planeSize));
+            AppendUint32(output, 0);
+            output[headerOffset] = static_cast<char>(AppendStaticPayload(planePiece, planeSize, output));
+            if (!PatchPayloadSize(output, headerOffset, planeSize))
+            {
+                output.resize(headerOffset); ///< A plane that does not compress is stored as it is.
+                AppendRawBlock(planePiece, planeSize, output);
+            }
+        }
+    }
+
+    /// @brief Checks a sampled plane count on the whole block: sizes the static tables and bits of
+    /// the planes (plus their nested headers) and of the unsplit block exactly.
+    bool PlanesPayOff(const char* data, size_t size, unsigned planeCount)
+    {
+        planeCounts.assign(256 * planeCount, 0);
+        histogram.assign(BlockAlphabetSize, 0);
+        size_t whole = size - size % planeCount;
+        for (size_t i = 0; i < size; i++)
+        {
+            unsigned byte = static_cast<unsigned char>(data[i]);
+            histogram[byte]++;
+            planeCounts[256 * (i < whole ? i % planeCount : planeCount - 1) + byte]++; ///< The partial record belongs to the last plane.
+        }
+        BuildStaticTable(histogram, options.topK, table, scratch);
+        uint64_t flatBits = StaticBlockBits(histogram, table, scratch);
+        uint64_t planeBits = 8 * (1 + planeCount * BlockHeaderSize);
+        for (unsigned plane = 0; plane < planeCount; plane++)
+        {
+            copy(planeCounts.begin() + 256 * plane, planeCounts.begin() + 256 * (plane + 1), histogram.begin());
+            histogram[EscapeSymbol] = 0;
+            BuildStaticTable(histogram, options.topK, table, scratch);
+            planeBits += StaticBlockBits(histogram, table, scratch);
+        }
+        return planeBits < flatBits;
+    }
+
+    /// @brief Writes the payload size into a block header.
+    /// @returns False, writing nothing, if the payload is not smaller than the raw bytes.
+    static bool PatchPayloadSize(string& output, size_t headerOffset, size_t rawSize)
+    {
+        size_t payloadSize = output.size() - headerOffset - BlockHeaderSize;
+        if (payloadSize >= rawSize)
+            return false;
+        for (int i = 0; i < 4; i++)
+            output[headerOffset + 5 + i] = static_cast<char>(payloadSize >> (8 * i));
+        return true;
+    }
+
+    /// @brief Returns the block as one range, joining its pieces if there are several.
+    const char* JoinPieces(const pmr::vector<ByteSpan>& pieces)
+    {
+        if (pieces.size() == 1)
+            return pieces[0].data;
+        joined.clear();
+        for (const ByteSpan& piece : pieces)
+            joined.insert(joined.end(), piece.data, piece.data + piece.size);
+        return joined.data();
+    }
+
+    /// @brief Appends one block made of several ranges to the archive, without joining them first.
+    ///
+    /// Filters and byte planes need the block in one range, so only they join the pieces.
+    /// @param pieces The ranges of the block.
+    /// @param output The archive.
+    void EncodeBlock(const pmr::vector<ByteSpan>& pieces, string& output)
+    {
+        size_t size = static_cast<size_t>(TotalSize(pieces));
+        bool startOfInput = atStartOfInput;
+        atStartOfInput = false;
+        uint8_t filter = 0;
+        const pmr::vector<ByteSpan>* coded = &pieces; ///< The bytes that get coded, filtered when a filter applies.
+        if (options.filter != 0 && !options.lagOne && size > 0)
+        {
+            const char* data = JoinPieces(pieces);
+            filter = options.filter == AutoFilter ? ChooseFilter(data, size, filterSample) : options.filter;
+            if (filter != 0)
+            {
+                filtered.resize(size);
+                ApplyFilter(filter, data, size, filtered.data());
+                filteredPiece.assign(1, ByteSpan{ filtered.data(), size });
+                coded = &filteredPiece;
+            }
+        }
+        if (options.prescreen && LooksIncompressible(*coded, size, startOfInput))
+        {
+            AppendRawBlock(pieces, size, output); ///< Lag-one state is left as it is, the decoder does the same.
+            if (options.metrics)
+                options.metrics->CountBlock(BlockMode::Raw);
+            return;
+        }
+
+        size_t headerOffset = output.size();
+        output.push_back(static_cast<char>(BlockMode::LagOne));
+        AppendUint32(output, static_cast<uint32_t>(size));
+        AppendUint32(output, 0); ///< Payload size, patched below.
+        if (options.lagOne)
+        {
+            BitWriter writer(output);
+            histogram.assign(BlockAlphabetSize, 0);
+            EncodeSymbols(pieces, previousTable, writer, histogram);
+            BuildLagOneTable(histogram, previousTable, scratch);
+            writer.Flush();
+            PatchPayloadSize(output, headerOffset, SIZE_MAX); ///< Always kept: the next table is already built from this block.
+            if (options.metrics)
+                options.metrics->CountBlock(BlockMode::LagOne);
+            return;
+        }
+
+        size_t modeOffset = headerOffset;
+        if (filter != 0)
+        {
+            output[headerOffset] = static_cast<char>(BlockMode::Filtered);
+            output.push_back(static_cast<char>(filter));
+            modeOffset = output.size();
+            output.push_back(0); ///< Mode of the filtered bytes, set below.
+        }
+        unsigned planeCount = options.planes;
+        const char* data = planeCount != 0 ? JoinPieces(*coded) : nullptr;
+        if (planeCount == AutoPlanes)
+        {
+            planeCount = ChoosePlaneCount(data, size, planeCounts);
+            if (planeCount > 1 && !PlanesPayOff(data, size, planeCount))
+                planeCount = 1;
+        }
+        if (planeCount > 1 && size >= planeCount)
+        {
+            output[modeOffset] = static_cast<char>(BlockMode::Planes);
+            AppendPlanesPayload(data, size, planeCount, output);
+        }
+        else
+            output[modeOffset] = static_cast<char>(AppendStaticPayload(*coded, size, output));
+
+        if (!PatchPayloadSize(output, headerOffset, size))
+        {
+            output.resize(headerOffset); ///< Coding expanded the block, store it instead.
+            AppendRawBlock(pieces, size, output);
+        }
+        if (options.metrics)
+            options.metrics->CountBlock(static_cast<BlockMode>(output[headerOffset]));
+    }
+};
+
+/// @struct BlockDecoder
+/// @brief Decodes consecutive blocks of one archive, mirroring BlockEncoder.
+struct BlockDecoder
+{
+    HuffmanTable previousTable; ///< Lag-one table built from the previous block.
+    HuffmanDecoder previousDecoder; ///< Decoder of previousTable.
+    HuffmanTable table; ///< Table of the current static block.
+    HuffmanDecoder decoder; ///< Decoder of table.
+    HuffmanScratch scratch; ///< Tree memory for building lag-one tables.
+    pmr::vector<unsigned> histogram; ///< Byte frequencies of the current block.
+    pmr::vector<char> planeBuffer; ///< Decoded byte planes of a Planes block.
+
+    explicit BlockDecoder(pmr::memory_resource* resource = pmr::get_default_resource())
+        : previousTable(resource), previousDecoder(resource), table(resource), decoder(resource), scratch(resource), histogram(resource),
+        planeBuffer(resource)
+    {
+        Reset();
+    }
+
+    /// @brief Starts a new archive, keeping the memory of the previous one.
+    void Reset()
+    {
+        histogram.assign(BlockAlphabetSize, 0);
+        BlockEncoder::BuildLagOneTable(histogram, previousTable, scratch);
+        BuildHuffmanDecoder(previousTable, previousDecoder);
+    }
+
+    /// @brief Decodes the symbols of a payload, a pair cut by rawSize only writes its first byte.
+    static void DecodeSymbols(BitReader& reader, size_t rawSize, const HuffmanDecoder& decoder, char* output, pmr::vector<unsigned>& histogram)
+    {
+        for (size_t i = 0; i < rawSize; i++)
+        {
+            unsigned symbol = DecodeSymbol(decoder, reader);
+            if (symbol == EscapeSymbol)
+                symbol = static_cast<unsigned>(reader.Read(8));
+            else if (symbol > EscapeSymbol)
+            {
+                unsigned pair = decoder.pairs[symbol - BlockAlphabetSize]; ///< Two bytes for one lookup.
+                histogram[pair >> 8]++;
+                output[i] = static_cast<char>(pair >> 8);
+                if (++i == rawSize)
+                    break;
+                symbol = pair & 0xFF;
+            }
+            histogram[symbol]++;
+            output[i] = static_cast<char>(symbol);
+        }
+    }
+
+    /// @brief Decodes one block and appends its bytes to the output.
+    /// @param header The header of the block.
+    /// @param payload Start of the block payload.
+    /// @param output Receives the decoded bytes.
+    void DecodeBlock(const BlockHeader& header, const char* payload, string& output)
+    {
+        size_t offset = output.size();
+        output.resize(offset + header.rawSize);
+        DecodeBlock(header, payload, &output[offset]);
+    }
+
+    /// @brief Decodes one block into caller provided memory.
+    /// @param header The header of the block.
+    /// @param payload Start of the block payload.
+    /// @param output Receives header.rawSize decoded bytes.
+    void DecodeBlock(const BlockHeader& header, const char* payload, char* output)
+    {
+        histogram.assign(BlockAlphabetSize, 0);
+        if (header.mode == BlockMode::LagOne)
+        {
+            BitReader reader(payload, header.payloadSize);
+            DecodeSymbols(reader, header.rawSize, previousDecoder, output, histogram);
+            BlockEncoder::BuildLagOneTable(histogram, previousTable, scratch);
+            BuildHuffmanDecoder(previousTable, previousDecoder);
+        }
+        else if (header.mode == BlockMode::Raw)
+        {
+            if (header.payloadSize != header.rawSize)
+                throw runtime_error("Invalid raw block in block archive.");
+            memcpy(output, payload, header.rawSize);
+        }
+        else if (header.mode == BlockMode::Filtered)
+        {
+            uint8_t filter = header.payloadSize >= 2 ? static_cast<uint8_t>(payload[0]) : 0;
+            BlockMode innerMode = header.payloadSize >= 2 ? static_cast<BlockMode>(payload[1]) : BlockMode::Filtered;
+            if (!IsValidFilter(filter) || (innerMode != BlockMode::PackedHuffman && innerMode != BlockMode::PairHuffman && innerMode != BlockMode::Planes))
+                throw runtime_error("Invalid filtered block in block archive.");
+            DecodeBlock(BlockHeader{ innerMode, header.rawSize, header.payloadSize - 2 }, payload + 2, output);
+            RemoveFilter(filter, output, header.rawSize);
+        }
+        else if (header.mode == BlockMode::Planes)
+        {
+            unsigned planeCount = header.payloadSize >= 1 ? static_cast<unsigned char>(payload[0]) : 0;
+            if (planeCount < 2 || planeCount > MaxPlanes || header.rawSize < planeCount)
+                throw runtime_error("Invalid planes block in block archive.");
+            planeBuffer.resize(header.rawSize);
+            size_t offset = 1, planeOffset = 0;
+            for (unsigned plane = 0; plane < planeCount; plane++)
+            {
+                if (header.payloadSize - offset < BlockHeaderSize)
+                    throw runtime_error("Truncated planes block in block archive.");
+                BlockHeader planeHeader{ static_cast<BlockMode>(payload[offset]), LoadUint32(payload + offset + 1), LoadUint32(payload + offset + 5) };
+                offset += BlockHeaderSize;
+                if (planeHeader.rawSize != PlaneSize(header.rawSize, planeCount, plane) || header.payloadSize - offset < planeHeader.payloadSize
+                    || (planeHeader.mode != BlockMode::PackedHuffman && planeHeader.mode != BlockMode::PairHuffman && planeHeader.mode != BlockMode::Raw))
+                    throw runtime_error("Invalid plane in block archive.");
+                DecodeBlock(planeHeader, payload + offset, planeBuffer.data() + planeOffset);
+                offset += planeHeader.payloadSize;
+                planeOffset += planeHeader.rawSize;
+            }
+            MergePlanes(planeBuffer.data(), header.rawSize, planeCount, output);
+        }
+        else if (StoresTable(header.mode))
+        {
+            size_t tableSize = ReadStoredTable(header.mode, payload, header.payloadSize, table, scratch);
+            BuildHuffmanDecoder(table, decoder);
+            BitReader reader(payload + tableSize, header.payloadSize - tableSize);
+            DecodeSymbols(reader, header.rawSize, decoder, output, histogram);
+        }
+        else
+            throw runtime_error("Unknown block mode in block archive.");
+    }
+};
+
+/// @brief Runs a function for every index in [0, count) on a pool of threads.
+///
+/// Indices are handed out one at a time, so uneven blocks balance across the workers.
+/// The first exception thrown by a worker is rethrown after all workers have finished.
+/// @param count Number of indices.
+/// @param threadCount Number of threads, including the calling one.
+/// @param function Called with each index.
+template <typename Function>
+void ParallelFor(size_t count, unsigned threadCount, Function function)
+{
+    atomic<size_t> next(0);
+    exception_ptr failure;
+    mutex failureMutex;
+    auto worker = [&]() {
+        try {
+            for (size_t index = next++; index < count; index = next++)
+                function(index);
+        }
+        catch (...) {
+            lock_guard<mutex> lock(failureMutex);
+            if (!failure)
+                failure = current_exception();
+            next = count; ///< Stops the other workers early.
+        }
+    };
+    vector<thread> workers;
+    for (unsigned i = 1; i < min<size_t>(threadCount, count); i++)
+        workers.emplace_back(worker);
+    worker();
+    for (thread& t : workers)
+        t.join();
+    if (failure)
+        rethrow_exception(failure);
+}
+
+/// @brief Compresses a scatter/gather list into a block archive in memory.
+///
+/// The spans are treated as one logical input: blocks may straddle span boundaries and are
+/// histogrammed and coded piece by piece, so the input is never joined into one buffer.
+/// @param input The ranges to compress, in order.
+/// @param options Archive settings.
+/// @returns The archive.
+string CompressBlocks(const vector<ByteSpan>& input, const BlockOptions& options)
+{
+    string output(BlockArchiveMagic, sizeof(BlockArchiveMagic));
+    BlockEncoder encoder(options);
+    SpanCursor<ByteSpan> cursor(input);
+    uint64_t remaining = TotalSize(input);
+    if (options.threadCount > 1 && !options.lagOne)
+    {
+        vector<pmr::vector<ByteSpan>> blocks;
+        for (; remaining > 0; remaining -= min<uint64_t>(remaining, options.blockSize))
+            blocks.push_back(cursor.Take(options.blockSize));
+        vector<string> encoded(blocks.size());
+        ParallelFor(blocks.size(), options.threadCount, [&](size_t block) { ///< Static blocks do not depend on each other.
+            BlockEncoder encoder(options);
+            encoder.atStartOfInput = block == 0;
+            encoder.EncodeBlock(blocks[block], encoded[block]);
+        });
+        for (const string& block : encoded)
+            output += block;
+        return output;
+    }
+    while (remaining > 0)
+    {
+        size_t size = static_cast<size_t>(min<uint64_t>(encoder.TakeBlockSize(), remaining));
+        encoder.EncodeBlock(cursor.Take(size), output);
+        remaining -= size;
+    }
+    return output;
+}
+
+/// @brief Compresses a string into a block archive in memory.
+/// @param input The bytes to compress.
+/// @param options Archive settings.
+/// @returns The archive.
+string CompressBlocks(const string& input, const BlockOptions& options)
+{
+    return CompressBlocks(vector<ByteSpan>{ { input.data(), input.size() } }, options);
+}
+
+/// @brief Checks the magic bytes of a block archive.
+/// @param input The archive.
+/// @returns Offset of the first block.
+size_t CheckBlockArchive(const string& input)
+{
+    if (input.size() < sizeof(BlockArchiveMagic) || input.compare(0, sizeof(BlockArchiveMagic), BlockArchiveMagic, sizeof(BlockArchiveMagic)) != 0)
+        throw runtime_error("Not a block archive.");
+    return sizeof(BlockArchiveMagic);
+}
+
+/// @struct BlockIndexEntry
+/// @brief Location of one block inside an archive and inside the decoded data.
+struct BlockIndexEntry
+{
+    BlockHeader header; ///< The block header.
+    size_t payloadOffset; ///< Offset of the payload in the archive.
+    uint64_t rawOffset; ///< Offset of the block's first byte in the decoded data.
+};
+
+/// @brief Walks the block headers of an archive into a reused list without decoding any payload.
+/// @param archive The archive.
+/// @param index Receives one entry per block, in archive order.
+template <typename IndexList>
+void ReadBlockIndex(const string& archive, IndexList& index)
+{
+    index.clear();
+    size_t offset = CheckBlockArchive(archive);
+    uint64_t rawOffset = 0;
+    while (offset < archive.size())
+    {
+        BlockIndexEntry entry;
+        entry.header = ReadBlockHeader(archive, offset);
+        if (offset + entry.header.payloadSize > archive.size())
+            throw runtime_error("Truncated block in block archive.");
+        entry.payloadOffset = offset;
+        entry.rawOffset = rawOffset;
+        index.push_back(entry);
+        offset += entry.header.payloadSize;
+        rawOffset += entry.header.rawSize;
+    }
+}
+
+/// @brief Walks the block headers of an archive without decoding any payload.
+/// @param archive The archive.
+/// @returns One entry per block, in archive order.
+vector<BlockIndexEntry> ReadBlockIndex(const string& archive)
+{
+    vector<BlockIndexEntry> index;
+    ReadBlockIndex(archive, index);
+    return index;
+}
+
+/// @brief Decompresses a block archive in memory into a scatter/gather list.
+///
+/// Blocks that fall inside one output span are decoded in place, blocks that straddle spans
+/// are decoded into a scratch buffer and copied piece by piece.
+/// @param input The archive.
+/// @param output The ranges to fill, in order; together they must hold the decoded data.
+/// @param threadCount Number of threads used for archives whose blocks store their own tables.
+/// @returns Number of decoded bytes.
+uint64_t DecompressBlocks(const string& input, const vector<MutableByteSpan>& output, unsigned threadCount = 1)
+{
+    vector<BlockIndexEntry> index = ReadBlockIndex(input);
+    bool independent = true;
+    uint64_t rawSize = 0;
+    for (const BlockIndexEntry& entry : index)
+    {
+        independent = independent && DecodesIndependently(entry.header.mode);
+        rawSize += entry.header.rawSize;
+    }
+    if (rawSize > TotalSize(output))
+        throw runtime_error("Output spans are too small for the decoded data.");
+
+    SpanCursor<MutableByteSpan> cursor(output);
+    vector<pmr::vector<MutableByteSpan>> targets;
+    for (const BlockIndexEntry& entry : index)
+        targets.push_back(cursor.Take(entry.header.rawSize));
+
+    BlockDecoder sequentialDecoder;
+    auto decode = [&](size_t block, BlockDecoder& decoder) {
+        const BlockIndexEntry& entry = index[block];
+        const char* payload = input.data() + entry.payloadOffset;
+        if (targets[block].size() == 1)
+        {
+            decoder.DecodeBlock(entry.header, payload, targets[block][0].data); ///< Straight into the caller's memory.
+            return;
+        }
+        string scratch;
+        decoder.DecodeBlock(entry.header, payload, scratch);
+        size_t offset = 0;
+        for (const MutableByteSpan& piece : targets[block])
+        {
+            memcpy(piece.data, scratch.data() + offset, piece.size);
+            offset += piece.size;
+        }
+    };
+    if (threadCount > 1 && independent)
+        ParallelFor(index.size(), threadCount, [&](size_t block) {
+            BlockDecoder decoder;
+            decode(block, decoder);
+        });
+    else
+        for (size_t block = 0; block < index.size(); block++)
+            decode(block, sequentialDecoder); ///< Lag-one state carries over between blocks.
+    return rawSize;
+}
+
+/// @brief Decompresses a block archive in memory.
+/// @param input The archive.
+/// @param threadCount Number of threads used for archives whose blocks store their own tables.
+/// @returns The decoded bytes.
+string DecompressBlocks(const string& input, unsigned threadCount = 1)
+{
+    uint64_t rawSize = 0;
+    for (const BlockIndexEntry& entry : ReadBlockIndex(input))
+        rawSize += entry.header.rawSize;
+    string output(rawSize, '\0');
+    DecompressBlocks(input, vector<MutableByteSpan>{ { output.data(), output.size() } }, threadCount);
+    return output;
+}
+
+/// @struct EncoderContext
+/// @brief Reusable in-memory archive encoder for callers that compress many buffers.
+///
+/// The context owns every table, histogram and piece list, and Compress reuses the capacity of
+/// the output string, so after the first calls have warmed it up a round of compression makes
+/// no heap allocations. All codec memory comes from the memory resource given at construction.
+/// A context is sequential; use one per thread.
+struct EncoderContext
+{
+    BlockEncoder encoder; ///< Block coder and its tables.
+    pmr::vector<ByteSpan> pieces; ///< Pieces of the current block.
+
+    explicit EncoderContext(const BlockOptions& options = BlockOptions(), pmr::memory_resource* resource = pmr::get_default_resource())
+        : encoder(options, resource), pieces(resource) {}
+
+    /// @brief Changes the archive settings of the following calls.
+    void Reset(const BlockOptions& options)
+    {
+        encoder.Reset(options);
+    }
+
+    /// @brief Compresses a scatter/gather list into an archive, replacing the output contents.
+    /// @param input The ranges to compress, in order.
+    /// @param output Receives the archive, its capacity is kept across calls.
+    void Compress(const vector<ByteSpan>& input, string& output)
+    {
+        Compress(SpanCursor<ByteSpan>(input), TotalSize(input), output);
+    }
+
+    /// @brief Compresses a contiguous buffer into an archive, replacing the output contents.
+    void Compress(const char* data, size_t size, string& output)
+    {
+        ByteSpan input{ data, size };
+        Compress(SpanCursor<ByteSpan>(&input, 1), size, output);
+    }
+
+    /// @brief Compresses the bytes of a cursor into an archive.
+    /// @param cursor The input ranges.
+    /// @param size Number of bytes to compress.
+    /// @param output Receives the archive.
+    void Compress(SpanCursor<ByteSpan> cursor, uint64_t size, string& output)
+    {
+        encoder.Reset(encoder.options); ///< Every archive starts without lag-one statistics.
+        output.assign(BlockArchiveMagic, sizeof(BlockArchiveMagic));
+        for (uint64_t remaining = size; remaining > 0;)
+        {
+            size_t blockSize = static_cast<size_t>(min<uint64_t>(encoder.TakeBlockSize(), remaining));
+            cursor.Take(blockSize, pieces);
+            encoder.EncodeBlock(pieces, output);
+            remaining -= blockSize;
+        }
+    }
+};
+
+/// @struct DecoderContext
+/// @brief Reusable in-memory archive decoder, the counterpart of EncoderContext.
+///
+/// Keeps the block index, the decoders and the scratch buffer for straddling blocks between
+/// calls, so steady-state decompression makes no heap allocations. Like EncoderContext it takes
+/// its memory from a caller supplied resource and is sequential; use one per thread.
+struct DecoderContext
+{
+    BlockDecoder decoder; ///< Block decoder and its tables.
+    pmr::vector<BlockIndexEntry> index; ///< Block index of the current archive.
+    pmr::vector<MutableByteSpan> pieces; ///< Output pieces of the current block.
+    pmr::string scratch; ///< Decoded bytes of a block that straddles output spans.
+
+    explicit DecoderContext(pmr::memory_resource* resource = pmr::get_default_resource())
+        : decoder(resource), index(resource), pieces(resource), scratch(resource) {}
+
+    /// @brief Decompresses an archive into a scatter/gather list.
+    /// @param archive The archive.
+    /// @param output The ranges to fill, in order; together they must hold the decoded data.
+    /// @returns Number of decoded bytes.
+    uint64_t Decompress(const string& archive, const vector<MutableByteSpan>& output)
+    {
+        ReadBlockIndex(archive, index);
+        return DecodeIndexed(archive, SpanCursor<MutableByteSpan>(output), TotalSize(output));
+    }
+
+    /// @brief Decompresses an archive, replacing the output contents and keeping its capacity.
+    void Decompress(const string& archive, string& output)
+    {
+        ReadBlockIndex(archive, index);
+        uint64_t rawSize = 0;
+        for (const BlockIndexEntry& entry : index)
+            rawSize += entry.header.rawSize;
+        output.resize(rawSize);
+        MutableByteSpan target{ output.data(), output.size() };
+        DecodeIndexed(archive, SpanCursor<MutableByteSpan>(&target, 1), output.size());
+    }
+
+    /// @brief Decodes the blocks of the current index in order.
+    /// @param archive The archive.
+    /// @param cursor The output ranges.
+    /// @param capacity Number of bytes the output ranges hold.
+    /// @returns Number of decoded bytes.
+    uint64_t DecodeIndexed(const string& archive, SpanCursor<MutableByteSpan> cursor, uint64_t capacity)
+    {
+        uint64_t rawSize = 0;
+        for (const BlockIndexEntry& entry : index)
+            rawSize += entry.header.rawSize;
+        if (rawSize > capacity)
+            throw runtime_error("Output spans are too small for the decoded data.");
+
+        decoder.Reset();
+        for (const BlockIndexEntry& entry : index)
+        {
+            const char* payload = archive.data() + entry.payloadOffset;
+            cursor.Take(entry.header.rawSize, pieces);
+            if (pieces.size() == 1)
+            {
+                decoder.DecodeBlock(entry.header, payload, pieces[0].data);
+                continue;
+            }
+            scratch.resize(entry.header.rawSize);
+            decoder.DecodeBlock(entry.header, payload, scratch.data());
+            size_t offset = 0;
+            for (const MutableByteSpan& piece : pieces)
+            {
+                memcpy(piece.data, scratch.data() + offset, piece.size);
+                offset += piece.size;
+            }
+        }
+        return rawSize;
+    }
+};
+
+/// @struct CallbackMemoryResource
+/// @brief Memory resource that forwards to plain allocate/free callbacks.
+///
+/// Lets callers route codec memory into their own allocator (a jemalloc arena, huge pages,
+/// NUMA-local memory, per-tenant accounting) without writing a memory_resource themselves.
+struct CallbackMemoryResource : pmr::memory_resource
+{
+    using AllocateFunction = void* (*)(size_t size, size_t alignment, void* userData); ///< Returns nullptr on failure.
+    using FreeFunction = void (*)(void* pointer, size_t size, size_t alignment, void* userData);
+
+    AllocateFunction allocateFunction; ///< Called for every allocation.
+    FreeFunction freeFunction; ///< Called for every release, with the size and alignment of the allocation.
+    void* userData; ///< Passed through to both callbacks.
+
+    CallbackMemoryResource(AllocateFunction allocateFunction, FreeFunction freeFunction, void* userData = nullptr)
+        : allocateFunction(allocateFunction), freeFunction(freeFunction), userData(userData) {}
+
+private:
+    void* do_allocate(size_t size, size_t alignment) override
+    {
+        void* pointer = allocateFunction(size, alignment, userData);
+        if (pointer == nullptr)
+            throw bad_alloc();
+        return pointer;
+    }
+
+    void do_deallocate(void* pointer, size_t size, size_t alignment) override
+    {
+        freeFunction(pointer, size, alignment, userData);
+    }
+
+    bool do_is_equal(const pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+/// @brief Magic bytes at the start of a line index file.
+const char LineIndexMagic[4] = { 'H', 'L', 'N', '1' };
+
+/// @brief Appends an unsigned LEB128 variable length integer to a byte string.
+void AppendVarint(string& output, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        output.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    output.push_back(static_cast<char>(value));
+}
+
+/// @brief Reads an unsigned LEB128 variable length integer and advances the offset.
+uint64_t ReadVarint(const string& input, size_t& offset)
+{
+    uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7)
+    {
+        if (offset >= input.size())
+            throw runtime_error("Unexpected end of variable length integer.");
+        unsigned char byte = static_cast<unsigned char>(input[offset++]);
+        value |= uint64_t(byte & 0x7F) << shift;
+        if (byte < 0x80)
+            return value;
+    }
+    throw runtime_error("Variable length integer is too long.");
+}
+
+/// @struct LineIndexBlock
+/// @brief Newline metadata of one archive block.
+struct LineIndexBlock
+{
+    uint64_t archiveOffset = 0; ///< Offset of the block header in the archive.
+    uint32_t newlineCount = 0; ///< Number of '\n' bytes in the block.
+    uint64_t positionOffset = 0; ///< Offset of the block's delta coded positions in the index file.
+    vector<uint32_t> positions; ///< Offsets of the '\n' bytes inside the block, empty until they are loaded.
+};
+
+/// @struct LineIndex
+/// @brief Sidecar index of the newlines of a block archive.
+///
+/// The file starts with a fixed size table (archive offset, newline count, position data offset)
+/// per block, so counting lines never touches the delta coded positions that follow it.
+struct LineIndex
+{
+    vector<LineIndexBlock> blocks; ///< One entry per archive block.
+    string fileName; ///< The loaded index file, LoadPositions reads from it.
+
+    /// @brief Records the newlines of a block.
+    void AddBlock(uint64_t archiveOffset, const char* data, size_t size)
+    {
+        LineIndexBlock block;
+        block.archiveOffset = archiveOffset;
+        for (const char* it = data; (it = static_cast<const char*>(memchr(it, '\n', data + size - it))) != nullptr; it++)
+            block.positions.push_back(static_cast<uint32_t>(it - data));
+        block.newlineCount = static_cast<uint32_t>(block.positions.size());
+        blocks.push_back(block);
+    }
+
+    /// @brief Total number of newlines.
+    uint64_t NewlineCount() const
+    {
+        uint64_t count = 0;
+        for (const LineIndexBlock& block : blocks)
+            count += block.newlineCount;
+        return count;
+    }
+
+    /// @brief Writes the index to a file.
+    void Save(const string& indexFileName) const
+    {
+        string positions;
+        string output(LineIndexMagic, sizeof(LineIndexMagic));
+        AppendUint64(output, blocks.size());
+        for (const LineIndexBlock& block : blocks)
+        {
+            AppendUint64(output, block.archiveOffset);
+            AppendUint32(output, block.newlineCount);
+            AppendUint64(output, positions.size());
+            uint32_t previous = 0;
+            for (uint32_t position : block.positions)
+            {
+                AppendVarint(positions, position - previous); ///< Positions are increasing, store the gaps.
+                previous = position;
+            }
+        }
+        ofstream indexFile(indexFileName, ios::binary);
+        indexFile.write(output.data(), output.size());
+        indexFile.write(positions.data(), positions.size());
+    }
+
+    /// @brief Reads an index file.
+    /// @param indexFileName The name of the index file.
+    /// @param withPositions Whether to decode the newline positions or only the per-block table.
+    void Load(const string& indexFileName, bool withPositions)
+    {
+        ifstream indexFile(indexFileName, ios::binary);
+        if (!indexFile)
+            throw runtime_error("Cannot open " + indexFileName);
+        string head(sizeof(LineIndexMagic) + 8, '\0');
+        if (!indexFile.read(&head[0], head.size()) || head.compare(0, sizeof(LineIndexMagic), LineIndexMagic, sizeof(LineIndexMagic)) != 0)
+            throw runtime_error("Not a line index: " + indexFileName);
+        size_t offset = sizeof(LineIndexMagic);
+        uint64_t blockCount = ReadUint64(head, offset);
+        uint64_t fileSize = fs::file_size(indexFileName);
+        if (blockCount > (fileSize - head.size()) / 20)
+            throw runtime_error("Truncated line index: " + indexFileName);
+        string table(blockCount * 20, '\0'); ///< Only the fixed size table is read, the positions stay on disk.
+        indexFile.read(&table[0], table.size());
+        uint64_t positionsStart = head.size() + table.size();
+        blocks.assign(blockCount, LineIndexBlock());
+        offset = 0;
+        for (LineIndexBlock& block : blocks)
+        {
+            block.archiveOffset = ReadUint64(table, offset);
+            block.newlineCount = ReadUint32(table, offset);
+            block.positionOffset = positionsStart + ReadUint64(table, offset);
+        }
+        fileName = indexFileName;
+        for (size_t block = 0; withPositions && block < blocks.size(); block++)
+            LoadPositions(block);
+    }
+
+    /// @brief Decodes the newline positions of one block, seeking to its stored offset.
+    /// @param block Index of the block.
+    void LoadPositions(size_t block)
+    {
+        LineIndexBlock& entry = blocks[block];
+        if (entry.positions.size() == entry.newlineCount)
+            return;
+        uint64_t fileSize = fs::file_size(fileName);
+        if (entry.positionOffset > fileSize)
+            throw runtime_error("Invalid position offset in line index: " + fileName);
+        string data(min<uint64_t>(fileSize - entry.positionOffset, 5 * uint64_t(entry.newlineCount)), '\0'); ///< A gap takes at most 5 bytes.
+        ifstream indexFile(fileName, ios::binary);
+        indexFile.seekg(static_cast<streamoff>(entry.positionOffset));
+        if (!indexFile.read(&data[0], data.size()))
+            throw runtime_error("Cannot read " + fileName);
+        size_t offset = 0;
+        uint32_t previous = 0;
+        entry.positions.clear();
+        for (uint32_t i = 0; i < entry.newlineCount; i++)
+            entry.positions.push_back(previous += static_cast<uint32_t>(ReadVarint(data, offset)));
+    }
+};
+
+/// @brief Reads the next block of an archive file.
+/// @param inputFile The archive, positioned at a block header.
+/// @param header Receives the block header.
+/// @param payload Receives the block payload.
+/// @returns False at the end of the archive.
+bool ReadArchiveBlock(ifstream& inputFile, BlockHeader& header, string& payload)
+{
+    string headerBytes(BlockHeaderSize, '\0');
+    if (!inputFile.read(&headerBytes[0], BlockHeaderSize))
+    {
+        if (inputFile.gcount() != 0)
+            throw runtime_error("Truncated block header in block archive.");
+        return false;
+    }
+    size_t offset = 0;
+    header = ReadBlockHeader(headerBytes, offset);
+    payload.resize(header.payloadSize);
+    if (!inputFile.read(&payload[0], header.payloadSize) && header.payloadSize > 0)
+        throw runtime_error("Truncated block in block archive.");
+    return true;
+}
+
+/// @brief Decodes a freshly encoded block and checks that it reproduces the input.
+/// @param decoder Decoder in the state the archive reader will have at this block.
+/// @param encoded The block (header and payload).
+/// @param data The input of the block.
+/// @param size Length of the input.
+/// @param decoded Scratch buffer for the decoded bytes.
+/// @param blockNumber Position of the block in the archive, for the error message.
+void VerifyBlock(BlockDecoder& decoder, const string& encoded, const char* data, size_t size, string& decoded, uint64_t blockNumber)
+{
+    size_t offset = 0;
+    BlockHeader header = ReadBlockHeader(encoded, offset);
+    decoded.clear();
+    if (header.rawSize == size && offset + header.payloadSize == encoded.size())
+        decoder.DecodeBlock(header, encoded.data() + offset, decoded);
+    if (decoded.size() != size || memcmp(decoded.data(), data, size) != 0)
+        throw runtime_error("Verification failed: block " + to_string(blockNumber) + " does not decode to its input.");
+}
+
+/// @struct SpscRing
+/// @brief Lock-free bounded queue for exactly one producer thread and one consumer thread.
+///
+/// The producer only writes `tail` and the consumer only writes `head`, so a push or pop is one
+/// acquire load and one release store. The two indices live on separate cache lines.
+template <typename T>
+struct SpscRing
+{
+    vector<T> slots; ///< Ring storage, the capacity is a power of two.
+    size_t mask; ///< capacity - 1.
+    alignas(64) atomic<size_t> head{ 0 }; ///< Next slot to pop, written by the consumer.
+    alignas(64) atomic<size_t> tail{ 0 }; ///< Next slot to push, written by the producer.
+
+    explicit SpscRing(size_t capacity) : slots(capacity), mask(capacity - 1) {}
+
+    /// @brief Number of queued values, exact for the producer and the consumer, approximate for others.
+    size_t Size() const
+    {
+        return tail.load(memory_order_acquire) - head.load(memory_order_acquire);
+    }
+
+    /// @brief Appends a value, returns false if the ring is full.
+    bool TryPush(const T& value)
+    {
+        size_t position = tail.load(memory_order_relaxed);
+        if (position - head.load(memory_order_acquire) == slots.size())
+            return false;
+        slots[position & mask] = value;
+        tail.store(position + 1, memory_order_release);
+        return true;
+    }
+
+    /// @brief Removes the oldest value, returns false if the ring is empty.
+    bool TryPop(T& value)
+    {
+        size_t position = head.load(memory_order_relaxed);
+        if (position == tail.load(memory_order_acquire))
+            return false;
+        value = slots[position & mask];
+        head.store(position + 1, memory_order_release);
+        return true;
+    }
+};
+
+/// @brief Retries a ring operation until it succeeds or the pipeline is aborted.
+///
+/// Spins with yields first, then sleeps briefly, so idle stages do not burn a core.
+/// @returns False if the pipeline was aborted.
+template <typename Operation>
+bool WaitFor(Operation operation, const atomic<bool>& aborted)
+{
+    for (unsigned attempt = 0; !operation(); attempt++)
+    {
+        if (aborted.load(memory_order_relaxed))
+            return false;
+        if (attempt < 64)
+            this_thread::yield();
+        else
+            this_thread::sleep_for(chrono::microseconds(50));
+    }
+    return true;
+}
+
+/// @struct PipelineBlock
+/// @brief Block descriptor passed between pipeline stages, its buffers are recycled.
+struct PipelineBlock
+{
+    uint64_t sequence = 0; ///< Position of the block in the archive.
+    string input; ///< Raw bytes of the block.
+    string output; ///< Encoded block (header and payload).
+    string decoded; ///< Verification scratch.
+};
+
+/// @brief Number of block descriptors owned by each encoder lane.
+const size_t PipelineLaneDepth = 4;
+
+/// @struct PipelineLane
+/// @brief One encoder's share of the pipeline: its descriptors and the three rings they travel through.
+///
+/// Block k goes through lane k % N, so every ring has one producer and one consumer and the
+/// writer restores the order by visiting the lanes round robin.
+struct PipelineLane
+{
+    vector<PipelineBlock> pool; ///< Descriptors of this lane.
+    SpscRing<PipelineBlock*> free; ///< Writer to reader: recycled descriptors.
+    SpscRing<PipelineBlock*> toEncode; ///< Reader to encoder: filled input, nullptr ends the stream.
+    SpscRing<PipelineBlock*> toVerify; ///< Encoder to verifier (with --verify): encoded blocks.
+    SpscRing<PipelineBlock*> toWrite; ///< Encoder or verifier to writer: checked blocks, nullptr ends the stream.
+
+    PipelineLane() : pool(PipelineLaneDepth), free(2 * PipelineLaneDepth), toEncode(2 * PipelineLaneDepth), toVerify(2 * PipelineLaneDepth),
+        toWrite(2 * PipelineLaneDepth) {}
+};
+
+/// @brief Compresses a file with a reader thread, N encoder threads and a writer, overlapping I/O and coding.
+///
+/// The stages hand block descriptors to each other through lock-free SPSC rings, and the
+/// descriptors' buffers are reused, so the steady state neither locks nor allocates.
+/// With --verify every lane gets a verifier thread between its encoder and the writer.
+/// Only static blocks are pipelined; lag-one blocks depend on each other.
+/// @param inputFileName The file to compress.
+/// @param outputFileName The archive.
+/// @param options Archive settings, threadCount is the number of encoder threads.
+void CompressFilePipelined(const string& inputFileName, const string& outputFileName, const BlockOptions& options)
+{
+    if (options.lagOne)
+        throw runtime_error("--pipeline needs static tables, lag-one blocks depend on each other.");
+    ifstream inputFile(inputFileName, ios::binary);
+    if (!inputFile)
+        throw runtime_error("Cannot open " + inputFileName);
+    ofstream outputFile(outputFileName, ios::binary);
+    outputFile.write(BlockArchiveMagic, sizeof(BlockArchiveMagic));
+
+    size_t laneCount = max(1u, options.threadCount);
+    vector<unique_ptr<PipelineLane>> lanes;
+    for (size_t i = 0; i < laneCount; i++)
+    {
+        lanes.push_back(make_unique<PipelineLane>());
+        for (PipelineBlock& block : lanes[i]->pool)
+            lanes[i]->free.TryPush(&block);
+    }
+
+    CodecMetrics* metrics = options.metrics;
+    if (metrics)
+    {
+        metrics->stageThreads[static_cast<unsigned>(MetricStage::Read)] = 1;
+        metrics->stageThreads[static_cast<unsigned>(MetricStage::Encode)] = static_cast<unsigned>(laneCount);
+        metrics->stageThreads[static_cast<unsigned>(MetricStage::Verify)] = options.verify ? static_cast<unsigned>(laneCount) : 0;
+        metrics->stageThreads[static_cast<unsigned>(MetricStage::Write)] = 1;
+        metrics->bytesOut += sizeof(BlockArchiveMagic);
+    }
+    atomic<bool> aborted(false);
+    exception_ptr failure;
+    mutex failureMutex;
+    auto fail = [&]() {
+        lock_guard<mutex> lock(failureMutex);
+        if (!failure)
+            failure = current_exception();
+        aborted = true;
+    };
+
+    vector<thread> stages;
+    stages.emplace_back([&]() { ///< Reader.
+        try {
+            for (size_t sequence = 0;; sequence++)
+            {
+                PipelineLane& lane = *lanes[sequence % laneCount];
+                PipelineBlock* block = nullptr;
+                if (!WaitFor([&]() { return lane.free.TryPop(block); }, aborted))
+                    return;
+                {
+                    StageTimer timer(metrics, MetricStage::Read);
+                    block->input.resize(options.blockSize);
+                    inputFile.read(&block->input[0], block->input.size());
+                    block->input.resize(static_cast<size_t>(inputFile.gcount()));
+                }
+                block->sequence = sequence;
+                if (block->input.empty())
+                    break;
+                if (!WaitFor([&]() { return lane.toEncode.TryPush(block); }, aborted))
+                    return;
+            }
+            for (unique_ptr<PipelineLane>& lane : lanes)
+                if (!WaitFor([&]() { return lane->toEncode.TryPush(nullptr); }, aborted))
+                    return;
+        }
+        catch (...) {
+            fail();
+        }
+    });
+    for (size_t i = 0; i < laneCount; i++)
+        stages.emplace_back([&, i]() { ///< Encoder of lane i.
+            try {
+                PipelineLane& lane = *lanes[i];
+                BlockEncoder encoder(options);
+                encoder.atStartOfInput = i == 0; ///< Lane 0 codes the first block.
+                for (;;)
+                {
+                    PipelineBlock* block = nullptr;
+                    if (!WaitFor([&]() { return lane.toEncode.TryPop(block); }, aborted))
+                        return;
+                    if (block != nullptr)
+                    {
+                        if (metrics)
+                            metrics->encodeQueueDepth.Observe(double(lane.toEncode.Size()));
+                        StageTimer timer(metrics, MetricStage::Encode);
+                        block->output.clear();
+                        encoder.EncodeBlock(block->input.data(), block->input.size(), block->output);
+                    }
+                    SpscRing<PipelineBlock*>& next = options.verify ? lane.toVerify : lane.toWrite;
+                    if (!WaitFor([&]() { return next.TryPush(block); }, aborted) || block == nullptr)
+                        return;
+                }
+            }
+            catch (...) {
+                fail();
+            }
+        });
+    for (size_t i = 0; i < laneCount && options.verify; i++)
+        stages.emplace_back([&, i]() { ///< Verifier of lane i.
+            try {
+                PipelineLane& lane = *lanes[i];
+                BlockDecoder decoder;
+                for (;;)
+                {
+                    PipelineBlock* block = nullptr;
+                    if (!WaitFor([&]() { return lane.toVerify.TryPop(block); }, aborted))
+                        return;
+                    if (block != nullptr)
+                    {
+                        StageTimer timer(metrics, MetricStage::Verify);
+                        VerifyBlock(decoder, block->output, block->input.data(), block->input.size(), block->decoded, block->sequence);
+                    }
+                    if (!WaitFor([&]() { return lane.toWrite.TryPush(block); }, aborted) || block == nullptr)
+                        return;
+                }
+            }
+            catch (...) {
+                fail();
+            }
+        });
+
+    LineIndex lineIndex;
+    try { ///< The calling thread is the writer.
+        uint64_t archiveOffset = sizeof(BlockArchiveMagic);
+        for (size_t sequence = 0;; sequence++)
+        {
+            PipelineLane& lane = *lanes[sequence % laneCount];
+            PipelineBlock* block = nullptr;
+            if (!WaitFor([&]() { return lane.toWrite.TryPop(block); }, aborted) || block == nullptr)
+                break;
+            if (metrics)
+            {
+                metrics->writeQueueDepth.Observe(double(lane.toWrite.Size()));
+                metrics->bytesIn += block->input.size();
+                metrics->bytesOut += block->output.size();
+            }
+            StageTimer timer(metrics, MetricStage::Write);
+            outputFile.write(block->output.data(), block->output.size());
+            if (options.lineIndex)
+                lineIndex.AddBlock(archiveOffset, block->input.data(), block->input.size());
+            archiveOffset += block->output.size();
+            lane.free.TryPush(block); ///< Never full, the lane owns only PipelineLaneDepth descriptors.
+        }
+        if (!outputFile)
+            throw runtime_error("Cannot write " + outputFileName);
+    }
+    catch (...) {
+        fail();
+    }
+    for (thread& stage : stages)
+        stage.join();
+    if (failure)
+        rethrow_exception(failure);
+    outputFile.close();
+    if (options.lineIndex)
+        lineIndex.Save(outputFileName + ".lines");
+}
+
+/// @brief Compresses a file into a block archive, reading and writing one block at a time.
+/// @param inputFileName The name of the file to compress.
+/// @param outputFileName The name of the archive to write.
+/// @param options Archive settings.
+void CompressFileBlocks(const string& inputFileName, const string& outputFileName, const BlockOptions& options)
+{
+    if (options.pipeline)
+    {
+        CompressFilePipelined(inputFileName, outputFileName, options);
+        return;
+    }
+    ifstream inputFile(inputFileName, ios::binary);
+    if (!inputFile)
+        throw runtime_error("Cannot open " + inputFileName);
+    ofstream outputFile(outputFileName, ios::binary);
+    outputFile.write(BlockArchiveMagic, sizeof(BlockArchiveMagic));
+
+    size_t batchSize = options.lagOne ? 1 : options.threadCount; ///< Lag-one blocks depend on each other and are coded one at a time.
+    vector<BlockEncoder> encoders(batchSize, BlockEncoder(options));
+    for (size_t i = 1; i < batchSize; i++)
+        encoders[i].atStartOfInput = false; ///< Slot 0 codes the first block.
+    vector<BlockDecoder> verifiers(options.verify ? batchSize : 0); ///< Lag-one verification keeps its state across batches like the encoder.
+    vector<string> blocks(batchSize), encoded(batchSize), decoded(batchSize);
+    uint64_t blockNumber = 0;
+    CodecMetrics* metrics = options.metrics;
+    if (metrics)
+    {
+        metrics->stageThreads[static_cast<unsigned>(MetricStage::Read)] = 1;
+        metrics->stageThreads[static_cast<unsigned>(MetricStage::Encode)] = static_cast<unsigned>(min<size_t>(batchSize, options.threadCount));
+        metrics->stageThreads[static_cast<unsigned>(MetricStage::Verify)] = options.verify ? metrics->stageThreads[static_cast<unsigned>(MetricStage::Encode)] : 0;
+        metrics->stageThreads[static_cast<unsigned>(MetricStage::Write)] = 1;
+        metrics->bytesOut += sizeof(BlockArchiveMagic);
+    }
+    LineIndex lineIndex;
+    uint64_t archiveOffset = sizeof(BlockArchiveMagic);
+    bool endOfInput = false;
+    while (!endOfInput)
+    {
+        size_t count = 0;
+        for (; count < batchSize && !endOfInput; count++)
+        {
+            StageTimer timer(metrics, MetricStage::Read);
+            blocks[count].resize(encoders[0].TakeBlockSize());
+            inputFile.read(&blocks[count][0], blocks[count].size());
+            blocks[count].resize(static_cast<size_t>(inputFile.gcount()));
+            endOfInput = !inputFile;
+            if (blocks[count].empty())
+                break;
+        }
+        ParallelFor(count, options.threadCount, [&](size_t i) {
+            {
+                StageTimer timer(metrics, MetricStage::Encode);
+                encoded[i].clear();
+                encoders[i].EncodeBlock(blocks[i].data(), blocks[i].size(), encoded[i]);
+            }
+            if (options.verify)
+            {
+                StageTimer timer(metrics, MetricStage::Verify);
+                VerifyBlock(verifiers[i], encoded[i], blocks[i].data(), blocks[i].size(), decoded[i], blockNumber + i);
+            }
+        });
+        blockNumber += count;
+        for (size_t i = 0; i < count; i++)
+        {
+            StageTimer timer(metrics, MetricStage::Write);
+            if (metrics)
+            {
+                metrics->bytesIn += blocks[i].size();
+                metrics->bytesOut += encoded[i].size();
+            }
+            outputFile.write(encoded[i].data(), encoded[i].size()); ///< Each batch is written as soon as it is coded.
+            if (options.lineIndex)
+                lineIndex.AddBlock(archiveOffset, blocks[i].data(), blocks[i].size());
+            archiveOffset += encoded[i].size();
+        }
+    }
+    outputFile.close();
+    if (options.lineIndex)
+        lineIndex.Save(outputFileName + ".lines");
+}
+
+/// @brief Decompresses a block archive file, a batch of blocks at a time.
+/// @param inputFileName The name of the archive.
+/// @param outputFileName The name of the file to write the decoded data to.
+/// @param threadCount Number of threads used for blocks that store their own tables.
+void DecompressFileBlocks(const string& inputFileName, const string& outputFileName, unsigned threadCount = 1)
+{
+    ifstream inputFile(inputFileName, ios::binary);
+    if (!inputFile)
+        throw runtime_error("Cannot open " + inputFileName);
+    string magic(sizeof(BlockArchiveMagic), '\0');
+    inputFile.read(&magic[0], magic.size());
+    CheckBlockArchive(magic);
+
+    ofstream outputFile(outputFileName, ios::binary);
+    BlockDecoder decoder;
+    vector<BlockHeader> headers(threadCount);
+    vector<string> payloads(threadCount), decoded(threadCount);
+    for (size_t count = threadCount; count == threadCount; )
+    {
+        bool independent = true;
+        for (count = 0; count < threadCount && ReadArchiveBlock(inputFile, headers[count], payloads[count]); count++)
+            independent = independent && DecodesIndependently(headers[count].mode);
+
+        auto decode = [&](size_t i) {
+            decoded[i].clear();
+            if (independent)
+                BlockDecoder().DecodeBlock(headers[i], payloads[i].data(), decoded[i]);
+            else
+                decoder.DecodeBlock(headers[i], payloads[i].data(), decoded[i]); ///< Lag-one state carries over between blocks.
+        };
+        if (independent)
+            ParallelFor(count, threadCount, decode);
+        else
+            for (size_t i = 0; i < count; i++)
+                decode(i);
+        for (size_t i = 0; i < count; i++)
+            outputFile.write(decoded[i].data(), decoded[i].size());
+    }
+    outputFile.close();
+}
+
+/// @brief Decodes a range of blocks of an archive file, seeking directly to the first one.
+///
+/// Lag-one blocks need the statistics of all earlier blocks, so those archives are decoded from the start.
+/// @param archiveFileName The name of the archive.
+/// @param index The line index of the archive.
+/// @param first Index of the first block to decode.
+/// @param last Index of the last block to decode.
+/// @param lastBlockStart Receives the offset of the last decoded block in the result.
+/// @returns The decoded bytes of blocks first..last.
+string DecodeArchiveBlocks(const string& archiveFileName, const LineIndex& index, size_t first, size_t last, size_t& lastBlockStart)
+{
+    ifstream inputFile(archiveFileName, ios::binary);
+    if (!inputFile)
+        throw runtime_error("Cannot open " + archiveFileName);
+    size_t block = first;
+    for (size_t scanned = first; scanned <= last && block > 0; scanned++)
+    {
+        inputFile.seekg(index.blocks[scanned].archiveOffset);
+        char mode = 0;
+        if (!inputFile.get(mode))
+            throw runtime_error("Line index does not match the archive.");
+        if (static_cast<BlockMode>(mode) == BlockMode::LagOne)
+            block = 0; ///< A lag-one block needs the statistics of every block before it, even after Raw blocks.
+    }
+
+    BlockHeader header;
+    string payload, decoded;
+    inputFile.seekg(index.blocks[block].archiveOffset);
+    if (!ReadArchiveBlock(inputFile, header, payload))
+        throw runtime_error("Line index does not match the archive.");
+
+    BlockDecoder decoder;
+    string output;
+    for (; ; block++)
+    {
+        decoded.clear();
+        decoder.DecodeBlock(header, payload.data(), decoded);
+        lastBlockStart = output.size();
+        if (block >= first)
+            output += decoded;
+        if (block == last || !ReadArchiveBlock(inputFile, header, payload))
+            break;
+    }
+    return output;
+}
+
+/// @brief Returns one line of an archive, decoding only the blocks that contain it.
+/// @param archiveFileName The name of the archive, its ".lines" index is read.
+/// @param lineNumber The 1-based line number.
+/// @returns The line without its newline.
+string ReadArchiveLine(const string& archiveFileName, uint64_t lineNumber)
+{
+    LineIndex index;
+    index.Load(archiveFileName + ".lines", false); ///< Positions are decoded only for the blocks holding the line.
+    if (lineNumber == 0 || index.blocks.empty())
+        throw runtime_error("Line number out of range.");
+
+    auto locate = [&](uint64_t newline, size_t& block, uint32_t& position) { ///< Finds the 1-based n-th newline.
+        for (block = 0; block < index.blocks.size(); block++)
+        {
+            if (newline <= index.blocks[block].newlineCount)
+            {
+                index.LoadPositions(block);
+                position = index.blocks[block].positions[newline - 1];
+                return true;
+            }
+            newline -= index.blocks[block].newlineCount;
+        }
+        return false;
+    };
+
+    size_t firstBlock = 0, lastBlock = index.blocks.size() - 1;
+    uint32_t startPosition = 0, endPosition = 0;
+    bool startsAfterNewline = lineNumber > 1;
+    if (startsAfterNewline && !locate(lineNumber - 1, firstBlock, startPosition))
+        throw runtime_error("Line number out of range.");
+    bool endsWithNewline = locate(lineNumber, lastBlock, endPosition);
+
+    size_t lastBlockStart = 0;
+    string blocks = DecodeArchiveBlocks(archiveFileName, index, firstBlock, endsWithNewline ? lastBlock : index.blocks.size() - 1, lastBlockStart);
+    size_t start = startsAfterNewline ? startPosition + 1 : 0;
+    if (!endsWithNewline)
+    {
+        if (start >= blocks.size())
+            throw runtime_error("Line number out of range."); ///< The file ends with a newline, there is no further line.
+        return blocks.substr(start);
+    }
+    return blocks.substr(start, lastBlockStart + endPosition - start);
+}
+
+/// @brief Magic bytes at the start of a batch archive.
+const char BatchArchiveMagic[4] = { 'H', 'B', 'T', '1' };
+
+/// @brief Largest number of shared tables tried when the cluster count is picked automatically (powers of two up to it).
+const unsigned MaxBatchClusters = 64;
+
+/// @struct BatchFile
+/// @brief One input file of a batch archive.
+struct BatchFile
+{
+    string name; ///< Path relative to the batch directory, with '/' separators.
+    string data; ///< File contents.
+    pmr::vector<unsigned> histogram; ///< Byte frequencies of the file.
+    unsigned cluster = 0; ///< Index of the shared table that codes the file.
+    bool raw = false; ///< Stored as it is, the pre-screen found it incompressible.
+};
+
+/// @brief Exact number of payload bits a file takes with a shared table, escapes included.
+uint64_t SharedTableBits(const pmr::vector<unsigned>& histogram, const HuffmanTable& table)
+{
+    uint64_t bits = 0;
+    for (unsigned symbol = 0; symbol < 256; symbol++)
+        if (histogram[symbol] > 0)
+            bits += uint64_t(histogram[symbol]) * (table.codeLengths[symbol] > 0 ? table.codeLengths[symbol] : table.codeLengths[EscapeSymbol] + 8);
+    return bits;
+}
+
+/// @brief Builds the shared table of every cluster from the summed histograms of its files.
+///
+/// The escape symbol always keeps a code, so any file can be coded with any table.
+/// @param files The files with their cluster assignment.
+/// @param clusterCount Number of clusters.
+/// @param tables Receives one table per cluster.
+/// @param scratch Tree memory.
+void BuildClusterTables(const vector<BatchFile>& files, unsigned clusterCount, vector<HuffmanTable>& tables, HuffmanScratch& scratch)
+{
+    vector<pmr::vector<unsigned>> sums(clusterCount, pmr::vector<unsigned>(BlockAlphabetSize, 0));
+    for (const BatchFile& file : files)
+        if (!file.raw)
+            for (unsigned symbol = 0; symbol < 256; symbol++)
+                sums[file.cluster][symbol] += file.histogram[symbol];
+    tables.resize(clusterCount);
+    for (unsigned cluster = 0; cluster < clusterCount; cluster++)
+    {
+        sums[cluster][EscapeSymbol] = 1;
+        BuildHuffmanTable(sums[cluster], tables[cluster], scratch);
+    }
+}
+
+/// @brief Groups files with similar histograms and builds one shared table per group.
+///
+/// Seeds are picked farthest-first (the file that the current tables code worst), then a few
+/// Lloyd rounds alternate between rebuilding the tables and moving every file to the table
+/// that codes it in the fewest bits.
+/// @param files The files, receive their cluster index.
+/// @param clusterCount Requested number of clusters (fewer if there are fewer files).
+/// @param tables Receives the shared tables.
+/// @param scratch Tree memory.
+/// @returns Payload bits of all files plus the bits of the stored tables.
+uint64_t ClusterFiles(vector<BatchFile>& files, unsigned clusterCount, vector<HuffmanTable>& tables, HuffmanScratch& scratch)
+{
+    clusterCount = max(1u, min<unsigned>(clusterCount, static_cast<unsigned>(files.size())));
+    vector<uint64_t> fileBits(files.size(), 0);
+    for (BatchFile& file : files)
+        file.cluster = 0;
+    for (unsigned seeds = 1; seeds < clusterCount; seeds++)
+    {
+        BuildClusterTables(files, seeds, tables, scratch);
+        size_t worst = 0;
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            fileBits[i] = files[i].raw ? 0 : SharedTableBits(files[i].histogram, tables[files[i].cluster]);
+            if (fileBits[i] > fileBits[worst])
+                worst = i;
+        }
+        files[worst].cluster = seeds; ///< The worst coded file seeds the next cluster.
+    }
+
+    for (int round = 0; round < 8; round++)
+    {
+        BuildClusterTables(files, clusterCount, tables, scratch);
+        bool moved = false;
+        for (BatchFile& file : files)
+        {
+            if (file.raw)
+                continue;
+            unsigned best = file.cluster;
+            uint64_t bestBits = SharedTableBits(file.histogram, tables[best]);
+            for (unsigned cluster = 0; cluster < clusterCount; cluster++)
+            {
+                uint64_t bits = SharedTableBits(file.histogram, tables[cluster]);
+                if (bits < bestBits)
+                {
+                    bestBits = bits;
+                    best = cluster;
+                }
+            }
+            moved = moved || best != file.cluster;
+            file.cluster = best;
+        }
+        if (!moved)
+            break;
+    }
+
+    BuildClusterTables(files, clusterCount, tables, scratch);
+    uint64_t totalBits = 0;
+    for (const BatchFile& file : files)
+        totalBits += file.raw ? 8 * file.data.size() : SharedTableBits(file.histogram, tables[file.cluster]);
+    for (const HuffmanTable& table : tables)
+        totalBits += 8 * PlanStoredTable(table, scratch).size;
+    return totalBits;
+}
+
+/// @brief Reads every regular file below a directory, in path order.
+vector<BatchFile> ReadBatchDirectory(const string& directoryName)
+{
+    if (!fs::is_directory(directoryName))
+        throw runtime_error(directoryName + " is not a directory.");
+    vector<BatchFile> files;
+    for (const fs::directory_entry& entry : fs::recursive_directory_iterator(directoryName))
+        if (entry.is_regular_file())
+        {
+            BatchFile file;
+            file.name = fs::relative(entry.path(), directoryName).generic_string();
+            file.data = ReadFile(entry.path().string());
+            pmr::vector<ByteSpan> pieces{ { file.data.data(), file.data.size() } };
+            CountSymbols(pieces, file.histogram);
+            file.raw = LooksIncompressible(pieces, file.data.size(), true); ///< Compressed files are stored and kept out of the clusters.
+            files.push_back(move(file));
+        }
+    sort(files.begin(), files.end(), [](const BatchFile& a, const BatchFile& b) { return a.name < b.name; });
+    return files;
+}
+
+/// @brief Compresses all files of a directory into one batch archive with shared tables.
+///
+/// Layout: magic, table count, the tables (stored like PackedHuffman block tables), file count,
+/// one directory entry per file (name, table, raw size, payload size), then the payloads.
+/// Files the pre-screen rejects, or that their table would expand, are stored as they are and
+/// reference the table index one past the last table.
+/// Every file is its own bit stream, so any file can be decoded with just its table.
+/// @param directoryName The directory to compress.
+/// @param outputFileName The archive.
+/// @param clusterCount Number of shared tables, 0 tries 1, 2, 4 ... MaxBatchClusters and keeps the count with the smallest archive.
+/// @param metrics Receives counters and stage timings if not null.
+void CompressBatch(const string& directoryName, const string& outputFileName, unsigned clusterCount, CodecMetrics* metrics)
+{
+    if (metrics)
+        for (MetricStage stage : { MetricStage::Read, MetricStage::Cluster, MetricStage::Encode, MetricStage::Write })
+            metrics->stageThreads[static_cast<unsigned>(stage)] = 1;
+    vector<BatchFile> files;
+    {
+        StageTimer timer(metrics, MetricStage::Read);
+        files = ReadBatchDirectory(directoryName);
+    }
+    HuffmanScratch scratch;
+    vector<HuffmanTable> tables;
+    StageTimer clusterTimer(metrics, MetricStage::Cluster);
+    if (clusterCount == 0)
+    {
+        uint64_t bestBits = UINT64_MAX;
+        for (unsigned candidate = 1; candidate <= min<size_t>(MaxBatchClusters, max<size_t>(files.size(), 1)); candidate *= 2)
+        {
+            uint64_t bits = ClusterFiles(files, candidate, tables, scratch);
+            if (bits < bestBits)
+            {
+                bestBits = bits;
+                clusterCount = candidate;
+            }
+        }
+    }
+    ClusterFiles(files, clusterCount, tables, scratch);
+    clusterTimer.Stop();
+
+    string output(BatchArchiveMagic, sizeof(BatchArchiveMagic));
+    AppendVarint(output, tables.size());
+    for (const HuffmanTable& table : tables)
+        WriteStoredTable(table, output, scratch);
+
+    vector<string> payloads(files.size());
+    pmr::vector<unsigned> histogram(BlockAlphabetSize, 0);
+    vector<bool> tableUsed(tables.size(), false);
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        StageTimer timer(metrics, MetricStage::Encode);
+        files[i].raw = files[i].raw || SharedTableBits(files[i].histogram, tables[files[i].cluster]) >= 8 * files[i].data.size();
+        if (metrics)
+            metrics->bytesIn += files[i].data.size();
+        if (files[i].raw)
+        {
+            files[i].cluster = static_cast<unsigned>(tables.size());
+            payloads[i] = files[i].data;
+            if (metrics)
+                metrics->blocks[static_cast<unsigned>(BlockMode::Raw)]++;
+            continue;
+        }
+        if (metrics)
+        {
+            metrics->blocks[static_cast<unsigned>(BlockMode::PackedHuffman)]++;
+            (tableUsed[files[i].cluster] ? metrics->tableCacheHits : metrics->tableCacheMisses)++; ///< Later files of a cluster reuse its table.
+        }
+        tableUsed[files[i].cluster] = true;
+        BitWriter writer(payloads[i]);
+        EncodeSymbols(pmr::vector<ByteSpan>{ { files[i].data.data(), files[i].data.size() } }, tables[files[i].cluster], writer, histogram);
+        writer.Flush();
+    }
+    AppendVarint(output, files.size());
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        AppendVarint(output, files[i].name.size());
+        output += files[i].name;
+        AppendVarint(output, files[i].cluster);
+        AppendVarint(output, files[i].data.size());
+        AppendVarint(output, payloads[i].size());
+    }
+    for (const string& payload : payloads)
+        output += payload;
+
+    StageTimer timer(metrics, MetricStage::Write);
+    ofstream outputFile(outputFileName, ios::binary);
+    outputFile.write(output.data(), output.size());
+    if (!outputFile)
+        throw runtime_error("Cannot write " + outputFileName);
+    if (metrics)
+        metrics->bytesOut += output.size();
+    cout << "Files: " << files.size() << ", shared tables: " << tables.size() << '\n';
+}
+
+/// @brief Decompresses a batch archive into a directory.
+/// @param archiveFileName The archive.
+/// @param directoryName The directory to recreate the files in.
+/// @param onlyName If not empty, only this file is decoded.
+void DecompressBatch(const string& archiveFileName, const string& directoryName, const string& onlyName)
+{
+    string archive = ReadFile(archiveFileName);
+    if (archive.compare(0, sizeof(BatchArchiveMagic), BatchArchiveMagic, sizeof(BatchArchiveMagic)) != 0)
+        throw runtime_error("Not a batch archive.");
+    size_t offset = sizeof(BatchArchiveMagic);
+    HuffmanScratch scratch;
+    uint64_t tableCount = ReadVarint(archive, offset);
+    if (tableCount > archive.size())
+        throw runtime_error("Invalid table count in batch archive.");
+    vector<HuffmanTable> tables(tableCount);
+    for (HuffmanTable& table : tables)
+        offset += ReadStoredTable(BlockMode::PackedHuffman, archive.data() + offset, archive.size() - offset, table, scratch);
+
+    uint64_t fileCount = ReadVarint(archive, offset);
+    if (fileCount > archive.size())
+        throw runtime_error("Invalid file count in batch archive.");
+    vector<BatchFile> files(fileCount);
+    vector<uint64_t> payloadSizes(files.size());
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        size_t nameLength = ReadVarint(archive, offset);
+        if (offset + nameLength > archive.size())
+            throw runtime_error("Truncated batch archive.");
+        files[i].name = archive.substr(offset, nameLength);
+        offset += nameLength;
+        files[i].cluster = static_cast<unsigned>(ReadVarint(archive, offset));
+        files[i].data.resize(ReadVarint(archive, offset));
+        payloadSizes[i] = ReadVarint(archive, offset);
+        fs::path name(files[i].name);
+        if (name.is_absolute() || find(name.begin(), name.end(), "..") != name.end() || files[i].cluster > tables.size())
+            throw runtime_error("Invalid entry " + files[i].name + " in batch archive.");
+    }
+
+    vector<HuffmanDecoder> decoders(tables.size());
+    bool found = onlyName.empty();
+    fs::create_directories(directoryName);
+    pmr::vector<unsigned> histogram(BlockAlphabetSize, 0);
+    for (size_t i = 0; i < files.size(); offset += payloadSizes[i], i++)
+    {
+        if (offset + payloadSizes[i] > archive.size())
+            throw runtime_error("Truncated batch archive.");
+        if (!onlyName.empty() && files[i].name != onlyName)
+            continue; ///< Files are independent, the others are skipped without decoding.
+        found = true;
+        if (files[i].cluster == tables.size())
+        {
+            if (payloadSizes[i] != files[i].data.size())
+                throw runtime_error("Invalid raw entry " + files[i].name + " in batch archive.");
+            memcpy(files[i].data.data(), archive.data() + offset, files[i].data.size());
+        }
+        else
+        {
+            HuffmanDecoder& decoder = decoders[files[i].cluster];
+            if (decoder.sortedSymbols.empty())
+                BuildHuffmanDecoder(tables[files[i].cluster], decoder); ///< Built once per table, on first use.
+            BitReader reader(archive.data() + offset, payloadSizes[i]);
+            BlockDecoder::DecodeSymbols(reader, files[i].data.size(), decoder, files[i].data.data(), histogram);
+        }
+
+        fs::path path = fs::path(directoryName) / files[i].name;
+        fs::create_directories(path.parent_path());
+        ofstream outputFile(path, ios::binary);
+        outputFile.write(files[i].data.data(), files[i].data.size());
+        if (!outputFile)
+            throw runtime_error("Cannot write " + path.string());
+    }
+    if (!found)
+        throw runtime_error(onlyName + " is not in the batch archive.");
+}
+
+/// @brief Magic bytes at the start of a token archive.
+const char TokenArchiveMagic[4] = { 'H', 'T', 'K', '1' };
+
+/// @brief Magic bytes at the start of a trained token dictionary.
+const char TokenDictionaryMagic[4] = { 'H', 'T', 'D', '1' };
+
+/// @brief Longest token, longer runs are split into several tokens.
+const size_t MaxTokenLength = 32;
+
+/// @brief Largest number of tokens in a dictionary.
+const size_t MaxDictionaryTokens = 1 << 16;
+
+/// @brief A token enters the dictionary if (count - 1) * (length - 1) reaches this, so repeated
+/// long tokens and frequent short ones pay for their dictionary entry.
+const uint64_t MinTokenGain = 8;
+
+/// @enum TokenClass
+/// @brief Byte classes of the tokenizer, a run of bytes of one class is one token.
+enum class TokenClass : uint8_t
+{
+    Letter, ///< Letters, '_' and bytes from 0x80, so UTF-8 words stay whole.
+    Digit, ///< Decimal digits.
+    Blank, ///< Spaces and tabs.
+    Other ///< Everything else, one byte per token.
+};
+
+/// @brief Classifies one byte for the tokenizer.
+TokenClass ClassifyByte(unsigned char byte)
+{
+    if ((byte | 0x20) >= 'a' && (byte | 0x20) <= 'z')
+        return TokenClass::Letter;
+    if (byte == '_' || byte >= 0x80)
+        return TokenClass::Letter;
+    if (byte >= '0' && byte <= '9')
+        return TokenClass::Digit;
+    if (byte == ' ' || byte == '\t')
+        return TokenClass::Blank;
+    return TokenClass::Other;
+}
+
+/// @brief Splits a text into words, numbers, blank runs and single separator bytes.
+/// @param data The text.
+/// @param size Length of the text.
+/// @param emit Called with every token in order, the tokens concatenate to the text.
+template <typename Function>
+void ForEachToken(const char* data, size_t size, Function emit)
+{
+    size_t start = 0;
+    while (start < size)
+    {
+        TokenClass tokenClass = ClassifyByte(static_cast<unsigned char>(data[start]));
+        size_t end = start + 1;
+        if (tokenClass != TokenClass::Other)
+            while (end < size && end - start < MaxTokenLength && ClassifyByte(static_cast<unsigned char>(data[end])) == tokenClass)
+                end++;
+        emit(string_view(data + start, end - start));
+        start = end;
+    }
+}
+
+/// @struct TokenDictionary
+/// @brief Tokens that get their own symbol, symbol BlockAlphabetSize + i codes token i.
+///
+/// Tokens outside the dictionary are coded byte by byte, so any text can be coded with any dictionary.
+struct TokenDictionary
+{
+    string bytes; ///< All tokens back to back, in sorted order.
+    vector<uint32_t> offsets{ 0 }; ///< Start of every token in bytes, plus the end of the last one.
+    unordered_map<string_view, unsigned> ids; ///< Token index by token, the views point into bytes.
+
+    TokenDictionary() = default;
+    TokenDictionary(const TokenDictionary&) = delete; ///< A copy or move would keep views into the source's bytes (short ones live in its small buffer).
+    TokenDictionary& operator=(const TokenDictionary&) = delete;
+
+    /// @brief Number of tokens.
+    size_t Size() const { return offsets.size() - 1; }
+
+    /// @brief Token with the given index.
+    string_view Token(size_t index) const { return string_view(bytes.data() + offsets[index], offsets[index + 1] - offsets[index]); }
+
+    /// @brief Replaces the tokens, which are sorted so equal dictionaries serialize equally.
+    void Assign(vector<string_view> tokens)
+    {
+        sort(tokens.begin(), tokens.end());
+        tokens.erase(unique(tokens.begin(), tokens.end()), tokens.end());
+        bytes.clear();
+        offsets.assign(1, 0);
+        for (string_view token : tokens)
+        {
+            bytes += token;
+            offsets.push_back(static_cast<uint32_t>(bytes.size()));
+        }
+        ids.clear();
+        ids.reserve(Size());
+        for (size_t i = 0; i < Size(); i++)
+            ids.emplace(Token(i), static_cast<unsigned>(i)); ///< Built after bytes stops growing, so the views stay valid.
+    }
+
+    /// @brief FNV-1a hash of the tokens and their lengths, ties an archive to the dictionary it was coded with.
+    uint64_t Hash() const
+    {
+        uint64_t hash = 0xCBF29CE484222325ull;
+        auto mix = [&](unsigned char byte) { hash = (hash ^ byte) * 0x100000001B3ull; };
+        for (size_t i = 0; i < Size(); i++)
+        {
+            mix(static_cast<unsigned char>(Token(i).size()));
+            for (char ch : Token(i))
+                mix(static_cast<unsigned char>(ch));
+        }
+        return hash;
+    }
+};
+
+/// @brief Counts the multi-byte tokens of a text.
+void CountTokens(const string& text, unordered_map<string_view, uint64_t>& counts)
+{
+    ForEachToken(text.data(), text.size(), [&](string_view token) {
+        if (token.size() > 1)
+            counts[token]++; ///< Single bytes already have a symbol.
+    });
+}
+
+/// @brief Picks the dictionary tokens: those that pass MinTokenGain, the most bytes covered first.
+vector<string_view> SelectTokens(const unordered_map<string_view, uint64_t>& counts)
+{
+    vector<pair<uint64_t, string_view>> candidates;
+    for (const auto& [token, count] : counts)
+        if ((count - 1) * (token.size() - 1) >= MinTokenGain)
+            candidates.emplace_back(count * token.size(), token);
+    sort(candidates.begin(), candidates.end(), [](const auto& a, const auto& b) { return a.first != b.first ? a.first > b.first : a.second < b.second; });
+    candidates.resize(min(candidates.size(), MaxDictionaryTokens));
+    vector<string_view> tokens;
+    for (const auto& candidate : candidates)
+        tokens.push_back(candidate.second);
+    return tokens;
+}
+
+/// @brief Appends a dictionary: token count, then the front-coded tokens as an in-memory block archive.
+///
+/// Sorted tokens share long prefixes, every token stores the shared length, the suffix length and the suffix.
+void AppendTokenDictionary(string& output, const TokenDictionary& dictionary)
+{
+    string frontCoded;
+    string_view previous;
+    for (size_t i = 0; i < dictionary.Size(); i++)
+    {
+        string_view token = dictionary.Token(i);
+        size_t shared = 0;
+        while (shared < token.size() && shared < previous.size() && token[shared] == previous[shared])
+            shared++;
+        AppendVarint(frontCoded, shared);
+        AppendVarint(frontCoded, token.size() - shared);
+        frontCoded += token.substr(shared);
+        previous = token;
+    }
+    string packed = CompressBlocks(frontCoded, BlockOptions());
+    AppendVarint(output, dictionary.Size());
+    AppendVarint(output, packed.size());
+    output += packed;
+}
+
+/// @brief Reads a dictionary written by AppendTokenDictionary.
+/// @param input The archive or dictionary file.
+/// @param offset Position of the dictionary, advanced past it.
+/// @param dictionary Receives the tokens.
+void ReadTokenDictionary(const string& input, size_t& offset, TokenDictionary& dictionary)
+{
+    uint64_t tokenCount = ReadVarint(input, offset);
+    uint64_t packedSize = ReadVarint(input, offset);
+    if (tokenCount > MaxDictionaryTokens || packedSize > input.size() - offset)
+        throw runtime_error("Invalid token dictionary.");
+    string frontCoded = DecompressBlocks(input.substr(offset, packedSize));
+    offset += packedSize;
+
+    vector<string> tokens;
+    size_t position = 0;
+    for (uint64_t i = 0; i < tokenCount; i++)
+    {
+        uint64_t shared = ReadVarint(frontCoded, position);
+        uint64_t suffix = ReadVarint(frontCoded, position);
+        if (shared > (tokens.empty() ? 0 : tokens.back().size()) || shared + suffix > MaxTokenLength || suffix > frontCoded.size() - position)
+            throw runtime_error("Invalid token dictionary.");
+        tokens.push_back((tokens.empty() ? string() : tokens.back().substr(0, shared)) + frontCoded.substr(position, suffix));
+        position += suffix;
+    }
+    dictionary.Assign(vector<string_view>(tokens.begin(), tokens.end()));
+    if (dictionary.Size() != tokenCount)
+        throw runtime_error("Invalid token dictionary.");
+}
+
+/// @brief Loads a dictionary written by TrainTokenDictionary.
+/// @param dictionaryFileName The dictionary file.
+/// @param dictionary Receives the tokens.
+void LoadTokenDictionary(const string& dictionaryFileName, TokenDictionary& dictionary)
+{
+    string input = ReadFile(dictionaryFileName);
+    if (input.compare(0, sizeof(TokenDictionaryMagic), TokenDictionaryMagic, sizeof(TokenDictionaryMagic)) != 0)
+        throw runtime_error(dictionaryFileName + " is not a token dictionary.");
+    size_t offset = sizeof(TokenDictionaryMagic);
+    ReadTokenDictionary(input, offset, dictionary);
+}
+
+/// @brief Trains a dictionary on sample files, for many small files that are too short to carry their own.
+/// @param inputFileNames The training files.
+/// @param dictionaryFileName The dictionary to write.
+void TrainTokenDictionary(const vector<string>& inputFileNames, const string& dictionaryFileName)
+{
+    vector<string> texts;
+    unordered_map<string_view, uint64_t> counts;
+    texts.reserve(inputFileNames.size()); ///< The counted views point into the texts.
+    for (const string& inputFileName : inputFileNames)
+    {
+        texts.push_back(ReadFile(inputFileName));
+        CountTokens(texts.back(), counts);
+    }
+    TokenDictionary dictionary;
+    dictionary.Assign(SelectTokens(counts));
+
+    string output(TokenDictionaryMagic, sizeof(TokenDictionaryMagic));
+    AppendTokenDictionary(output, dictionary);
+    ofstream outputFile(dictionaryFileName, ios::binary);
+    outputFile.write(output.data(), output.size());
+    if (!outputFile)
+        throw runtime_error("Cannot write " + dictionaryFileName);
+    cout << "Dictionary tokens: " << dictionary.Size() << '\n';
+}
+
+/// @brief Maps a text to token archive symbols: dictionary tokens to their symbol, other tokens to their bytes.
+template <typename Function>
+void ForEachTokenSymbol(const string& text, const TokenDictionary& dictionary, Function emit)
+{
+    ForEachToken(text.data(), text.size(), [&](string_view token) {
+        auto found = token.size() > 1 ? dictionary.ids.find(token) : dictionary.ids.end();
+        if (found != dictionary.ids.end())
+            emit(BlockAlphabetSize + found->second);
+        else
+            for (char ch : token)
+                emit(static_cast<unsigned char>(ch));
+    });
+}
+
+/// @brief Compresses a text with one Huffman code over bytes and whole tokens.
+///
+/// Layout: magic, raw size, dictionary kind (0: the dictionary follows, 1: a trained dictionary
+/// identified by its hash), the table (stored like a PackedHuffman block table over
+/// BlockAlphabetSize + dictionary size symbols, the escape unused), then the coded symbols.
+/// @param text The text to compress.
+/// @param dictionaryFileName A trained dictionary, or empty to build one from the text.
+/// @param report Receives the dictionary and symbol counts.
+/// @returns The archive.
+string CompressTokenText(const string& text, const string& dictionaryFileName, ostream& report)
+{
+    string output(TokenArchiveMagic, sizeof(TokenArchiveMagic));
+    AppendVarint(output, text.size());
+    TokenDictionary dictionary;
+    if (dictionaryFileName.empty())
+    {
+        unordered_map<string_view, uint64_t> counts;
+        CountTokens(text, counts);
+        dictionary.Assign(SelectTokens(counts));
+        output.push_back(0);
+        AppendTokenDictionary(output, dictionary);
+    }
+    else
+    {
+        LoadTokenDictionary(dictionaryFileName, dictionary);
+        output.push_back(1);
+        AppendUint64(output, dictionary.Hash());
+    }
+
+    pmr::vector<unsigned> histogram(BlockAlphabetSize + dictionary.Size(), 0);
+    uint64_t symbolCount = 0;
+    ForEachTokenSymbol(text, dictionary, [&](unsigned symbol) { histogram[symbol]++; symbolCount++; });
+    HuffmanScratch scratch;
+    HuffmanTable table;
+    BuildHuffmanTable(histogram, table, scratch);
+    WriteStoredTable(table, output, scratch);
+    BitWriter writer(output);
+    ForEachTokenSymbol(text, dictionary, [&](unsigned symbol) { writer.Write(table.codes[symbol], table.codeLengths[symbol]); });
+    writer.Flush();
+    report << "Dictionary tokens: " << dictionary.Size() << ", coded symbols: " << symbolCount << '\n';
+    return output;
+}
+
+/// @brief Compresses a file with the token codec.
+/// @param inputFileName The file to compress.
+/// @param outputFileName The archive.
+/// @param dictionaryFileName A trained dictionary, or empty to build one from the file.
+void CompressTokens(const string& inputFileName, const string& outputFileName, const string& dictionaryFileName)
+{
+    string output = CompressTokenText(ReadFile(inputFileName), dictionaryFileName, cout);
+    ofstream outputFile(outputFileName, ios::binary);
+    outputFile.write(output.data(), output.size());
+    if (!outputFile)
+        throw runtime_error("Cannot write " + outputFileName);
+}
+
+/// @brief Decompresses a token archive, every decoded symbol writes a whole token.
+/// @param archive The archive.
+/// @param dictionaryFileName The trained dictionary the archive was coded with, if any.
+/// @returns The restored text.
+string DecompressTokenText(const string& archive, const string& dictionaryFileName)
+{
+    if (archive.compare(0, sizeof(TokenArchiveMagic), TokenArchiveMagic, sizeof(TokenArchiveMagic)) != 0)
+        throw runtime_error("Not a token archive.");
+    size_t offset = sizeof(TokenArchiveMagic);
+    uint64_t rawSize = ReadVarint(archive, offset);
+    if (offset >= archive.size())
+        throw runtime_error("Truncated token archive.");
+    TokenDictionary dictionary;
+    char kind = archive[offset++];
+    if (kind == 0)
+        ReadTokenDictionary(archive, offset, dictionary);
+    else if (kind == 1)
+    {
+        if (dictionaryFileName.empty())
+            throw runtime_error("The archive was coded with a trained dictionary, pass it with --dictionary.");
+        LoadTokenDictionary(dictionaryFileName, dictionary);
+        if (ReadUint64(archive, offset) != dictionary.Hash())
+            throw runtime_error(dictionaryFileName + " is not the dictionary the archive was coded with.");
+    }
+    else
+        throw runtime_error("Unknown dictionary kind in token archive.");
+
+    HuffmanScratch scratch;
+    HuffmanTable table;
+    offset += ReadStoredTable(archive.data() + offset, archive.size() - offset, BlockAlphabetSize + dictionary.Size(), table, scratch);
+    if (table.codeLengths[EscapeSymbol] != 0)
+        throw runtime_error("Invalid Huffman table in token archive.");
+    HuffmanDecoder decoder;
+    BuildHuffmanDecoder(table, decoder);
+    if (rawSize > 0 && decoder.sortedSymbols.empty())
+        throw runtime_error("Invalid Huffman table in token archive.");
+    if (rawSize / MaxTokenLength > 8 * (archive.size() - offset))
+        throw runtime_error("Invalid size in token archive."); ///< Every symbol takes at least one bit.
+
+    string text(rawSize, '\0');
+    BitReader reader(archive.data() + offset, archive.size() - offset);
+    size_t position = 0;
+    while (position < rawSize)
+    {
+        unsigned symbol = DecodeSymbol(decoder, reader);
+        if (symbol < 256)
+        {
+            text[position++] = static_cast<char>(symbol);
+            continue;
+        }
+        string_view token = dictionary.Token(symbol - BlockAlphabetSize);
+        if (token.size() > rawSize - position)
+            throw runtime_error("Token past the end of the token archive.");
+        memcpy(text.data() + position, token.data(), token.size());
+        position += token.size();
+    }
+    return text;
+}
+
+/// @brief Decompresses a token archive file.
+/// @param inputFileName The archive.
+/// @param outputFileName The restored file.
+/// @param dictionaryFileName The trained dictionary the archive was coded with, if any.
+void DecompressTokens(const string& inputFileName, const string& outputFileName, const string& dictionaryFileName)
+{
+    string text = DecompressTokenText(ReadFile(inputFileName), dictionaryFileName);
+    ofstream outputFile(outputFileName, ios::binary);
+    outputFile.write(text.data(), text.size());
+    if (!outputFile)
+        throw runtime_error("Cannot write " + outputFileName);
+}
+
+/// @brief Magic bytes at the start of a wide-symbol archive.
+const char WideArchiveMagic[4] = { 'H', 'W', 'S', '1' };
+
+/// @brief Lookup bits of wide-symbol decoders, enough for one lookup per symbol on large alphabets.
+const unsigned WideDecodeTableBits = 14;
+
+/// @brief First symbol of the invalid UTF-8 bytes, byte b becomes InvalidUtf8Symbol + b.
+const char32_t InvalidUtf8Symbol = 0x110000;
+
+/// @struct WideSymbolTraits
+/// @brief How a symbol type is read from and written to bytes, specialized per supported type.
+/// @tparam Symbol uint8_t (bytes), uint16_t (little endian units, e.g. UTF-16) or char32_t (UTF-8 code points).
+template <typename Symbol>
+struct WideSymbolTraits;
+
+template <>
+struct WideSymbolTraits<uint8_t>
+{
+    static constexpr uint8_t Kind = 1; ///< Symbol type byte in the archive.
+    static constexpr const char* Name = "u8"; ///< Name on the command line.
+
+    /// @brief Reads one symbol, returns the bytes it took (0 if too few bytes are left).
+    static size_t Parse(const char* data, size_t, uint8_t& symbol)
+    {
+        symbol = static_cast<uint8_t>(data[0]);
+        return 1;
+    }
+
+    /// @brief Writes one symbol, returns its length (at most 4 bytes).
+    static size_t Append(uint8_t symbol, char* output)
+    {
+        output[0] = static_cast<char>(symbol);
+        return 1;
+    }
+
+    /// @brief Whether a stored alphabet value is a symbol Parse can return.
+    static bool IsValid(uint64_t value) { return value <= 0xFF; }
+};
+
+template <>
+struct WideSymbolTraits<uint16_t>
+{
+    static constexpr uint8_t Kind = 2; ///< Symbol type byte in the archive.
+    static constexpr const char* Name = "u16"; ///< Name on the command line.
+
+    /// @brief Reads one little endian unit, an odd last byte is left over.
+    static size_t Parse(const char* data, size_t size, uint16_t& symbol)
+    {
+        if (size < 2)
+            return 0;
+        symbol = static_cast<uint16_t>(static_cast<unsigned char>(data[0]) | (static_cast<unsigned char>(data[1]) << 8));
+        return 2;
+    }
+
+    /// @brief Writes one little endian unit.
+    static size_t Append(uint16_t symbol, char* output)
+    {
+        output[0] = static_cast<char>(symbol);
+        output[1] = static_cast<char>(symbol >> 8);
+        return 2;
+    }
+
+    /// @brief Whether a stored alphabet value is a symbol Parse can return.
+    static bool IsValid(uint64_t value) { return value <= 0xFFFF; }
+};
+
+template <>
+struct WideSymbolTraits<char32_t>
+{
+    static constexpr uint8_t Kind = 3; ///< Symbol type byte in the archive.
+    static constexpr const char* Name = "utf8"; ///< Name on the command line.
+
+    /// @brief Reads one well-formed UTF-8 sequence as its code point.
+    ///
+    /// Overlong forms, surrogates, values past U+10FFFF and stray bytes are not well-formed; their
+    /// first byte becomes InvalidUtf8Symbol + byte, so any input round-trips byte for byte.
+    static size_t Parse(const char* data, size_t size, char32_t& symbol)
+    {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+        unsigned char lead = bytes[0];
+        symbol = lead < 0x80 ? lead : InvalidUtf8Symbol + lead;
+        size_t length = 0;
+        char32_t value = 0;
+        unsigned char low = 0x80, high = 0xBF; ///< Allowed range of the second byte (DFA of the Unicode standard, table 3-7).
+        if (lead >= 0xC2 && lead <= 0xDF)
+        {
+            length = 2;
+            value = lead & 0x1F;
+        }
+        else if (lead >= 0xE0 && lead <= 0xEF)
+        {
+            length = 3;
+            value = lead & 0x0F;
+            low = lead == 0xE0 ? 0xA0 : 0x80;
+            high = lead == 0xED ? 0x9F : 0xBF;
+        }
+        else if (lead >= 0xF0 && lead <= 0xF4)
+        {
+            length = 4;
+            value = lead & 0x07;
+            low = lead == 0xF0 ? 0x90 : 0x80;
+            high = lead == 0xF4 ? 0x8F : 0xBF;
+        }
+        else
+            return 1;
+        if (size < length || bytes[1] < low || bytes[1] > high)
+            return 1;
+        for (size_t i = 1; i < length; i++)
+        {
+            if (i > 1 && (bytes[i] & 0xC0) != 0x80)
+                return 1;
+            value = (value << 6) | (bytes[i] & 0x3F);
+        }
+        symbol = value;
+        return length;
+    }
+
+    /// @brief Writes a code point as UTF-8, an invalid byte symbol as that byte.
+    static size_t Append(char32_t symbol, char* output)
+    {
+        if (symbol < 0x80 || symbol >= InvalidUtf8Symbol)
+        {
+            output[0] = static_cast<char>(symbol < 0x80 ? symbol : symbol - InvalidUtf8Symbol);
+            return 1;
+        }
+        size_t length = symbol < 0x800 ? 2 : symbol < 0x10000 ? 3 : 4;
+        static const unsigned char leads[] = { 0, 0, 0xC0, 0xE0, 0xF0 };
+        for (size_t i = length - 1; i > 0; i--, symbol >>= 6)
+            output[i] = static_cast<char>(0x80 | (symbol & 0x3F));
+        output[0] = static_cast<char>(leads[length] | symbol);
+        return length;
+    }
+
+    /// @brief Whether a stored alphabet value is a symbol Parse can return.
+    static bool IsValid(uint64_t value)
+    {
+        return value < InvalidUtf8Symbol + 0x100 && (value < 0xD800 || value > 0xDFFF) && (value < InvalidUtf8Symbol || value >= InvalidUtf8Symbol + 0x80);
+    }
+};
+
+/// @brief Splits a text into symbols.
+/// @param text The text.
+/// @param emit Called with every symbol in order.
+/// @returns Number of bytes at the end that form no symbol (an odd byte of a u16 text).
+template <typename Symbol, typename Function>
+size_t ForEachWideSymbol(const string& text, Function emit)
+{
+    size_t position = 0;
+    Symbol symbol;
+    while (position < text.size())
+    {
+        size_t length = WideSymbolTraits<Symbol>::Parse(text.data() + position, text.size() - position, symbol);
+        if (length == 0)
+            break;
+        emit(symbol);
+        position += length;
+    }
+    return text.size() - position;
+}
+
+/// @struct WideAlphabet
+/// @brief The symbols a text uses, in ascending order, and the dense code index of each.
+///
+/// Narrow symbols are indexed through a direct table, code points through a hash map,
+/// so a sparse alphabet (a few thousand CJK characters out of 1.1 million) costs only what it uses.
+template <typename Symbol>
+struct WideAlphabet
+{
+    static constexpr bool Direct = sizeof(Symbol) <= 2; ///< Whether every possible symbol gets a table slot.
+
+    vector<Symbol> symbols; ///< Symbols that occur, ascending, symbol i has code index i.
+    vector<unsigned> directIndex; ///< Code index + 1 by symbol value, 0 if absent (narrow symbols).
+    unordered_map<Symbol, unsigned> mappedIndex; ///< Code index by symbol (code points).
+
+    /// @brief Collects the symbols of a text and counts them into a histogram over code indexes.
+    void Count(const string& text, pmr::vector<unsigned>& histogram)
+    {
+        vector<unsigned> directCounts(Direct ? size_t(1) << (8 * sizeof(Symbol)) : 0, 0);
+        unordered_map<Symbol, unsigned> mappedCounts;
+        ForEachWideSymbol<Symbol>(text, [&](Symbol symbol) {
+            if constexpr (Direct)
+                directCounts[symbol]++;
+            else
+                mappedCounts[symbol]++;
+        });
+        symbols.clear();
+        if constexpr (Direct)
+        {
+            for (size_t value = 0; value < directCounts.size(); value++)
+                if (directCounts[value] > 0)
+                    symbols.push_back(static_cast<Symbol>(value));
+        }
+        else
+        {
+            for (const auto& [symbol, count] : mappedCounts)
+                symbols.push_back(symbol);
+            sort(symbols.begin(), symbols.end());
+        }
+        Index();
+        histogram.assign(max<size_t>(symbols.size(), BlockAlphabetSize), 0); ///< Padded so the stored table formats apply unchanged.
+        for (size_t i = 0; i < symbols.size(); i++)
+            histogram[i] = Direct ? directCounts[symbols[i]] : mappedCounts[symbols[i]];
+    }
+
+    /// @brief Builds the symbol to code index lookup from symbols.
+    void Index()
+    {
+        directIndex.assign(Direct ? size_t(1) << (8 * sizeof(Symbol)) : 0, 0);
+        mappedIndex.clear();
+        for (size_t i = 0; i < symbols.size(); i++)
+            if constexpr (Direct)
+                directIndex[symbols[i]] = static_cast<unsigned>(i + 1);
+            else
+                mappedIndex.emplace(symbols[i], static_cast<unsigned>(i));
+    }
+
+    /// @brief Code index of a symbol that occurs in the text.
+    unsigned operator[](Symbol symbol) const
+    {
+        if constexpr (Direct)
+            return directIndex[symbol] - 1;
+        else
+            return mappedIndex.find(symbol)->second;
+    }
+};
+
+/// @brief Compresses a text with one Huffman code over its wide symbols.
+///
+/// Layout after the magic: symbol type, raw size, left-over bytes (count, then the bytes),
+/// alphabet (count, then the first symbol and the gaps between consecutive symbols), the table
+/// (stored like a PackedHuffman block table, padded to at least BlockAlphabetSize entries),
+/// then the coded symbols.
+/// @tparam Symbol uint8_t, uint16_t or char32_t.
+/// @param text The text.
+/// @returns The archive.
+template <typename Symbol>
+string CompressWide(const string& text)
+{
+    using Traits = WideSymbolTraits<Symbol>;
+    WideAlphabet<Symbol> alphabet;
+    pmr::vector<unsigned> histogram;
+    alphabet.Count(text, histogram);
+
+    string output(WideArchiveMagic, sizeof(WideArchiveMagic));
+    output.push_back(static_cast<char>(Traits::Kind));
+    AppendVarint(output, text.size());
+    size_t tail = ForEachWideSymbol<Symbol>(text, [](Symbol) {});
+    AppendVarint(output, tail);
+    output.append(text, text.size() - tail, tail);
+    AppendVarint(output, alphabet.symbols.size());
+    uint64_t previous = 0;
+    for (size_t i = 0; i < alphabet.symbols.size(); i++)
+    {
+        AppendVarint(output, alphabet.symbols[i] - previous); ///< Ascending symbols, the gaps are small on clustered scripts.
+        previous = alphabet.symbols[i];
+    }
+
+    HuffmanScratch scratch;
+    HuffmanTable table;
+    BuildHuffmanTable(histogram, table, scratch);
+    WriteStoredTable(table, output, scratch);
+    BitWriter writer(output);
+    ForEachWideSymbol<Symbol>(text, [&](Symbol symbol) {
+        unsigned index = alphabet[symbol];
+        writer.Write(table.codes[index], table.codeLengths[index]);
+    });
+    writer.Flush();
+    return output;
+}
+
+/// @brief Decompresses the part of a wide-symbol archive after the symbol type byte.
+///
+/// Every code index is expanded to its bytes up front, so decoding is one table lookup and
+/// one short copy per symbol.
+/// @tparam Symbol The symbol type the archive was coded with.
+/// @param archive The archive.
+/// @param offset Position after the symbol type byte.
+/// @returns The text.
+template <typename Symbol>
+string DecompressWide(const string& archive, size_t offset)
+{
+    using Traits = WideSymbolTraits<Symbol>;
+    uint64_t rawSize = ReadVarint(archive, offset);
+    uint64_t tail = ReadVarint(archive, offset);
+    if (tail > rawSize || tail > 4 || tail > archive.size() - offset)
+        throw runtime_error("Invalid left-over bytes in wide-symbol archive.");
+    string tailBytes = archive.substr(offset, tail);
+    offset += tail;
+
+    uint64_t symbolCount = ReadVarint(archive, offset);
+    if (symbolCount > archive.size() - offset)
+        throw runtime_error("Invalid alphabet in wide-symbol archive.");
+    struct Expansion
+    {
+        char bytes[4]; ///< UTF-8 of the symbol, at most 4 bytes.
+        size_t length; ///< Number of valid bytes.
+    };
+    vector<Expansion> expansions(symbolCount);
+    uint64_t value = 0;
+    for (uint64_t i = 0; i < symbolCount; i++)
+    {
+        uint64_t gap = ReadVarint(archive, offset);
+        if ((i > 0 && gap == 0) || gap > 0xFFFFFFFF || !Traits::IsValid(value + gap))
+            throw runtime_error("Invalid alphabet in wide-symbol archive.");
+        value += gap;
+        expansions[i].length = Traits::Append(static_cast<Symbol>(value), expansions[i].bytes);
+    }
+
+    HuffmanScratch scratch;
+    HuffmanTable table;
+    offset += ReadStoredTable(archive.data() + offset, archive.size() - offset, max<size_t>(symbolCount, BlockAlphabetSize), table, scratch);
+    HuffmanDecoder decoder;
+    BuildHuffmanDecoder(table, decoder, WideDecodeTableBits);
+    uint64_t bodySize = rawSize - tail;
+    if (bodySize > 0 && decoder.sortedSymbols.empty())
+        throw runtime_error("Invalid Huffman table in wide-symbol archive.");
+    if (bodySize / 4 > 8 * (archive.size() - offset))
+        throw runtime_error("Invalid size in wide-symbol archive."); ///< Every symbol takes at least one bit and at most 4 bytes.
+
+    string text(bodySize, '\0');
+    BitReader reader(archive.data() + offset, archive.size() - offset);
+    size_t position = 0;
+    while (position < bodySize)
+    {
+        unsigned index = DecodeSymbol(decoder, reader);
+        if (index >= symbolCount || expansions[index].length > bodySize - position)
+            throw runtime_error("Invalid symbol in wide-symbol archive.");
+        memcpy(text.data() + position, expansions[index].bytes, expansions[index].length);
+        position += expansions[index].length;
+    }
+    return text + tailBytes;
+}
+
+/// @brief Compresses a text with the wide-symbol codec.
+/// @param text The text to compress.
+/// @param symbolType "u8", "u16" or "utf8".
+/// @returns The archive.
+string CompressWideText(const string& text, const string& symbolType)
+{
+    if (symbolType == WideSymbolTraits<uint8_t>::Name)
+        return CompressWide<uint8_t>(text);
+    if (symbolType == WideSymbolTraits<uint16_t>::Name)
+        return CompressWide<uint16_t>(text);
+    if (symbolType == WideSymbolTraits<char32_t>::Name)
+        return CompressWide<char32_t>(text);
+    throw runtime_error("Unknown symbol type " + symbolType + ", use u8, u16 or utf8.");
+}
+
+/// @brief Compresses a file with the wide-symbol codec.
+/// @param inputFileName The file to compress.
+/// @param outputFileName The archive.
+/// @param symbolType "u8", "u16" or "utf8".
+void CompressWideFile(const string& inputFileName, const string& outputFileName, const string& symbolType)
+{
+    string output = CompressWideText(ReadFile(inputFileName), symbolType);
+    ofstream outputFile(outputFileName, ios::binary);
+    outputFile.write(output.data(), output.size());
+    if (!outputFile)
+        throw runtime_error("Cannot write " + outputFileName);
+}
+
+/// @brief Decompresses a wide-symbol archive, the symbol type is read from the archive.
+string DecompressWideText(const string& archive)
+{
+    if (archive.size() <= sizeof(WideArchiveMagic) || archive.compare(0, sizeof(WideArchiveMagic), WideArchiveMagic, sizeof(WideArchiveMagic)) != 0)
+        throw runtime_error("Not a wide-symbol archive.");
+    size_t offset = sizeof(WideArchiveMagic) + 1;
+    uint8_t kind = static_cast<uint8_t>(archive[sizeof(WideArchiveMagic)]);
+    if (kind == WideSymbolTraits<uint8_t>::Kind)
+        return DecompressWide<uint8_t>(archive, offset);
+    if (kind == WideSymbolTraits<uint16_t>::Kind)
+        return DecompressWide<uint16_t>(archive, offset);
+    if (kind == WideSymbolTraits<char32_t>::Kind)
+        return DecompressWide<char32_t>(archive, offset);
+    throw runtime_error("Unknown symbol type in wide-symbol archive.");
+}
+
+/// @brief Decompresses a wide-symbol archive file.
+void DecompressWideFile(const string& inputFileName, const string& outputFileName)
+{
+    string text = DecompressWideText(ReadFile(inputFileName));
+    ofstream outputFile(outputFileName, ios::binary);
+    outputFile.write(text.data(), text.size());
+    if (!outputFile)
+        throw runtime_error("Cannot write " + outputFileName);
+}
+
+/// @brief Magic bytes at the start of a column archive.
+const char ColumnArchiveMagic[4] = { 'H', 'C', 'V', '1' };
+
+/// @brief Most columns per row, the last column keeps the rest of longer rows with their delimiters.
+const size_t MaxColumns = 256;
+
+/// @brief Finds the end of a delimited field, quotes toggle whether delimiters and newlines count.
+/// @param data The text.
+/// @param position Start of the field.
+/// @param size Length of the text.
+/// @param delimiter The field delimiter.
+/// @param lastColumn Whether the field is in the last column, which only ends at a newline.
+/// @returns Position of the delimiter or newline that ends the field, or size.
+size_t FindFieldEnd(const char* data, size_t position, size_t size, char delimiter, bool lastColumn)
+{
+    bool quoted = false;
+    for (; position < size; position++)
+    {
+        char ch = data[position];
+        if (ch == '"')
+            quoted = !quoted; ///< Doubled quotes inside a quoted field toggle twice.
+        else if (!quoted && (ch == '\n' || (ch == delimiter && !lastColumn)))
+            break;
+    }
+    return position;
+}
+
+/// @brief Picks the delimiter of a table from its first line: the most frequent of ',', tab, ';' and '|'.
+char DetectDelimiter(const string& text)
+{
+    size_t lineEnd = min(text.find('\n'), text.size());
+    char best = ',';
+    size_t bestCount = 0;
+    for (char candidate : { ',', '\t', ';', '|' })
+    {
+        size_t count = static_cast<size_t>(std::count(text.begin(), text.begin() + lineEnd, candidate));
+        if (count > bestCount)
+        {
+            bestCount = count;
+            best = candidate;
+        }
+    }
+    return best;
+}
+
+/// @brief Compresses delimited text (CSV, TSV) column by column.
+///
+/// The text is cut into row groups of about one block size. Within a group every column is
+/// gathered into its own stream, each field followed by the byte that ended it (the delimiter,
+/// a newline, or nothing at the end of the text), and every stream is coded as one nested block
+/// with its own table. Layout: magic, delimiter, raw size, then per group its raw size, its
+/// column count and one block (header and payload) per column.
+/// Quoted fields keep their quotes, so any text, well-formed or not, round-trips.
+/// @param text The text to compress.
+/// @param delimiter The field delimiter, 0 detects it.
+/// @param blockSize Raw bytes per row group.
+/// @param report Receives the row group and column counts.
+/// @returns The archive.
+string CompressColumnText(const string& text, char delimiter, size_t blockSize, ostream& report)
+{
+    if (delimiter == 0)
+        delimiter = DetectDelimiter(text);
+    string output(ColumnArchiveMagic, sizeof(ColumnArchiveMagic));
+    output.push_back(delimiter);
+    AppendVarint(output, text.size());
+
+    BlockEncoder encoder{ BlockOptions() };
+    vector<string> columns;
+    size_t position = 0, groups = 0, maxColumns = 0;
+    while (position < text.size())
+    {
+        size_t groupStart = position, columnCount = 0;
+        for (string& column : columns)
+            column.clear();
+        while (position < text.size() && position - groupStart < blockSize)
+        {
+            for (size_t column = 0;; column++)
+            {
+                size_t end = FindFieldEnd(text.data(), position, text.size(), delimiter, column + 1 == MaxColumns);
+                size_t next = min(end + 1, text.size()); ///< The ending byte stays with the field.
+                if (column == columns.size())
+                    columns.emplace_back();
+                columns[column].append(text, position, next - position);
+                columnCount = max(columnCount, column + 1);
+                position = next;
+                if (end == text.size() || text[end] == '\n')
+                    break;
+            }
+        }
+        AppendVarint(output, position - groupStart);
+        AppendVarint(output, columnCount);
+        for (size_t column = 0; column < columnCount; column++)
+            encoder.EncodeBlock(columns[column].data(), columns[column].size(), output);
+        groups++;
+        maxColumns = max(maxColumns, columnCount);
+    }
+    report << "Row groups: " << groups << ", columns: " << maxColumns << '\n';
+    return output;
+}
+
+/// @brief Compresses a delimited file column by column.
+/// @param inputFileName The file to compress.
+/// @param outputFileName The archive.
+/// @param delimiter The field delimiter, 0 detects it.
+/// @param blockSize Raw bytes per row group.
+void CompressColumns(const string& inputFileName, const string& outputFileName, char delimiter, size_t blockSize)
+{
+    string output = CompressColumnText(ReadFile(inputFileName), delimiter, blockSize, cout);
+    ofstream outputFile(outputFileName, ios::binary);
+    outputFile.write(output.data(), output.size());
+    if (!outputFile)
+        throw runtime_error("Cannot write " + outputFileName);
+}
+
+/// @brief Decompresses a column archive, reassembling the rows field by field.
+/// @param archive The archive.
+/// @returns The restored text.
+string DecompressColumnText(const string& archive)
+{
+    if (archive.size() <= sizeof(ColumnArchiveMagic) || archive.compare(0, sizeof(ColumnArchiveMagic), ColumnArchiveMagic, sizeof(ColumnArchiveMagic)) != 0)
+        throw runtime_error("Not a column archive.");
+    size_t offset = sizeof(ColumnArchiveMagic);
+    char delimiter = archive[offset++];
+    uint64_t rawSize = ReadVarint(archive, offset);
+
+    string text;
+    BlockDecoder decoder;
+    vector<string> columns;
+    vector<size_t> cursors;
+    while (text.size() < rawSize)
+    {
+        uint64_t groupSize = ReadVarint(archive, offset);
+        uint64_t columnCount = ReadVarint(archive, offset);
+        if (groupSize == 0 || groupSize > rawSize - text.size() || columnCount == 0 || columnCount > MaxColumns)
+            throw runtime_error("Invalid row group in column archive.");
+        columns.resize(columnCount);
+        cursors.assign(columnCount, 0);
+        for (string& column : columns)
+        {
+            BlockHeader header = ReadBlockHeader(archive, offset);
+            if (header.payloadSize > archive.size() - offset || header.rawSize > groupSize)
+                throw runtime_error("Truncated column block.");
+            column.clear();
+            decoder.DecodeBlock(header, archive.data() + offset, column);
+            offset += header.payloadSize;
+        }
+
+        size_t groupEnd = text.size() + groupSize, column = 0;
+        while (text.size() < groupEnd)
+        {
+            const string& stream = columns[column];
+            size_t& cursor = cursors[column];
+            if (cursor >= stream.size())
+                throw runtime_error("Column stream ends early in column archive.");
+            size_t end = FindFieldEnd(stream.data(), cursor, stream.size(), delimiter, column + 1 == MaxColumns);
+            size_t next = min(end + 1, stream.size());
+            text.append(stream, cursor, next - cursor);
+            cursor = next;
+            if (end == stream.size() || stream[end] == '\n')
+                column = 0;
+            else if (++column == columnCount)
+                throw runtime_error("Row has more fields than columns in column archive.");
+        }
+        if (text.size() != groupEnd)
+            throw runtime_error("Row group size mismatch in column archive.");
+    }
+    return text;
+}
+
+/// @brief Decompresses a column archive file.
+/// @param inputFileName The archive.
+/// @param outputFileName The restored file.
+void DecompressColumns(const string& inputFileName, const string& outputFileName)
+{
+    string text = DecompressColumnText(ReadFile(inputFileName));
+    ofstream outputFile(outputFileName, ios::binary);
+    outputFile.write(text.data(), text.size());
+    if (!outputFile)
+        throw runtime_error("Cannot write " + outputFileName);
+}
+
+/// @brief Magic bytes at the start of a log template archive.
+const char LogArchiveMagic[4] = { 'H', 'L', 'T', '1' };
+
+/// @brief Number of field streams, later fields of a line share the last stream.
+const size_t MaxLogFieldStreams = 32;
+
+/// @brief Largest number of templates, template IDs are 16 bits and 0 marks a literal line.
+const size_t MaxLogTemplates = 0xFFFF;
+
+/// @brief Lines whose template occurs fewer times are stored literally.
+const uint64_t MinTemplateCount = 2;
+
+/// @brief Whether a byte separates the words of a log line.
+bool IsLogDelimiter(char ch)
+{
+    switch (ch)
+    {
+    case ' ': case '\t': case '=': case ',': case ';': case '"': case '[': case ']': case '(': case ')': case '{': case '}':
+        return true;
+    default:
+        return false;
+    }
+}
+
+/// @brief Splits a log line into its template and its variable fields, the words that contain a digit.
+/// @param line The line without its newline.
+/// @param constants Receives the n + 1 constant pieces around the n fields.
+/// @param fields Receives the fields.
+void SplitLogLine(string_view line, vector<string_view>& constants, vector<string_view>& fields)
+{
+    constants.clear();
+    fields.clear();
+    size_t constantStart = 0, position = 0;
+    while (position < line.size())
+    {
+        if (IsLogDelimiter(line[position]))
+        {
+            position++;
+            continue;
+        }
+        size_t end = position;
+        bool variable = false;
+        for (; end < line.size() && !IsLogDelimiter(line[end]); end++)
+            variable = variable || (line[end] >= '0' && line[end] <= '9'); ///< Timestamps, ids, counters, addresses.
+        if (variable)
+        {
+            constants.push_back(line.substr(constantStart, position - constantStart));
+            fields.push_back(line.substr(position, end - position));
+            constantStart = end;
+        }
+        position = end;
+    }
+    constants.push_back(line.substr(constantStart));
+}
+
+/// @brief Serializes a template: field count, then every constant piece with its length.
+void AppendLogTemplate(string& output, const vector<string_view>& constants)
+{
+    AppendVarint(output, constants.size() - 1);
+    for (string_view constant : constants)
+    {
+        AppendVarint(output, constant.size());
+        output += constant;
+    }
+}
+
+/// @brief Field stream of the field with the given index in its line.
+size_t LogFieldStream(size_t field)
+{
+    return min(field, MaxLogFieldStreams - 1);
+}
+
+/// @brief Appends a length-prefixed section.
+void AppendSection(string& output, const string& section)
+{
+    AppendVarint(output, section.size());
+    output += section;
+}
+
+/// @brief Reads a section written by AppendSection.
+string ReadSection(const string& input, size_t& offset)
+{
+    uint64_t size = ReadVarint(input, offset);
+    if (size > input.size() - offset)
+        throw runtime_error("Truncated section in log archive.");
+    offset += size;
+    return input.substr(offset - size, size);
+}
+
+/// @brief Calls lineFunction(line) for every line of a text, without the newline.
+template <typename Function>
+void ForEachLine(const string& text, Function lineFunction)
+{
+    size_t start = 0;
+    while (start < text.size())
+    {
+        size_t end = min(text.find('\n', start), text.size());
+        lineFunction(string_view(text.data() + start, end - start));
+        start = end + 1;
+    }
+}
+
+/// @brief Compresses a log file as templates, template IDs and variable fields.
+///
+/// Every line is split into words; words with a digit are fields, the rest of the line is its
+/// template. Templates seen at least MinTemplateCount times form the dictionary, other lines go
+/// to a literal stream. Layout after the magic: raw size, then sections: the template
+/// dictionary (block archive), the line IDs (16-bit wide-symbol archive), the literal lines
+/// (block archive), the number of field streams and one block archive per stream, field k of a
+/// line going to stream min(k, MaxLogFieldStreams - 1). Every stream gets its own tables.
+/// @param text The log text.
+/// @param report Receives the template, line and stream counts.
+/// @returns The archive.
+string CompressLogText(const string& text, ostream& report)
+{
+    vector<string_view> constants, fields;
+    unordered_map<string, uint64_t> counts;
+    string key;
+    ForEachLine(text, [&](string_view line) {
+        SplitLogLine(line, constants, fields);
+        key.clear();
+        AppendLogTemplate(key, constants);
+        counts[key]++;
+    });
+
+    vector<pair<uint64_t, string>> ranked;
+    for (auto& [templateKey, count] : counts)
+        if (count >= MinTemplateCount)
+            ranked.emplace_back(count, templateKey);
+    sort(ranked.begin(), ranked.end(), [](const auto& a, const auto& b) { return a.first != b.first ? a.first > b.first : a.second < b.second; });
+    ranked.resize(min(ranked.size(), MaxLogTemplates));
+    unordered_map<string, uint16_t> ids;
+    string dictionary;
+    AppendVarint(dictionary, ranked.size());
+    for (size_t i = 0; i < ranked.size(); i++)
+    {
+        ids.emplace(ranked[i].second, static_cast<uint16_t>(i + 1));
+        dictionary += ranked[i].second;
+    }
+
+    string lineIds, literals;
+    vector<string> fieldStreams;
+    ForEachLine(text, [&](string_view line) {
+        SplitLogLine(line, constants, fields);
+        key.clear();
+        AppendLogTemplate(key, constants);
+        auto found = ids.find(key);
+        uint16_t id = found == ids.end() ? 0 : found->second;
+        lineIds.push_back(static_cast<char>(id));
+        lineIds.push_back(static_cast<char>(id >> 8));
+        if (id == 0)
+        {
+            literals += line;
+            literals.push_back('\n');
+            return;
+        }
+        for (size_t field = 0; field < fields.size(); field++)
+        {
+            size_t stream = LogFieldStream(field);
+            if (stream >= fieldStreams.size())
+                fieldStreams.resize(stream + 1);
+            fieldStreams[stream] += fields[field];
+            fieldStreams[stream].push_back('\n');
+        }
+    });
+
+    string output(LogArchiveMagic, sizeof(LogArchiveMagic));
+    AppendVarint(output, text.size());
+    AppendSection(output, CompressBlocks(dictionary, BlockOptions()));
+    AppendSection(output, CompressWide<uint16_t>(lineIds));
+    AppendSection(output, CompressBlocks(literals, BlockOptions()));
+    AppendVarint(output, fieldStreams.size());
+    for (const string& stream : fieldStreams)
+        AppendSection(output, CompressBlocks(stream, BlockOptions()));
+    report << "Templates: " << ranked.size() << ", lines: " << lineIds.size() / 2 << ", literal lines: "
+        << count(literals.begin(), literals.end(), '\n') << ", field streams: " << fieldStreams.size() << '\n';
+    return output;
+}
+
+/// @brief Compresses a log file as templates, template IDs and variable fields.
+/// @param inputFileName The log file.
+/// @param outputFileName The archive.
+void CompressLogs(const string& inputFileName, const string& outputFileName)
+{
+    string output = CompressLogText(ReadFile(inputFileName), cout);
+    ofstream outputFile(outputFileName, ios::binary);
+    outputFile.write(output.data(), output.size());
+    if (!outputFile)
+        throw runtime_error("Cannot write " + outputFileName);
+}
+
+/// @struct LogArchive
+/// @brief A parsed log template archive, field streams stay compressed until they are needed.
+struct LogArchive
+{
+    uint64_t rawSize = 0; ///< Size of the original log.
+    vector<vector<string>> templates; ///< Constant pieces of every template, template ID i + 1 is templates[i].
+    string lineIds; ///< Template ID of every line, 16 bits little endian, 0 for a literal line.
+    string packedLiterals; ///< Block archive of the literal lines, decoded only when the whole log is restored.
+    vector<string> packedFields; ///< Block archives of the field streams.
+
+    /// @brief Parses an archive, decoding the dictionary and the IDs; literal lines and field streams stay compressed.
+    void Load(const string& archive)
+    {
+        if (archive.compare(0, sizeof(LogArchiveMagic), LogArchiveMagic, sizeof(LogArchiveMagic)) != 0)
+            throw runtime_error("Not a log archive.");
+        size_t offset = sizeof(LogArchiveMagic);
+        rawSize = ReadVarint(archive, offset);
+
+        string dictionary = DecompressBlocks(ReadSection(archive, offset));
+        size_t position = 0;
+        uint64_t templateCount = ReadVarint(dictionary, position);
+        if (templateCount > MaxLogTemplates)
+            throw runtime_error("Invalid template dictionary in log archive.");
+        templates.assign(templateCount, {});
+        for (vector<string>& constants : templates)
+        {
+            uint64_t fieldCount = ReadVarint(dictionary, position);
+            if (fieldCount > dictionary.size())
+                throw runtime_error("Invalid template dictionary in log archive.");
+            for (uint64_t i = 0; i <= fieldCount; i++)
+            {
+                uint64_t size = ReadVarint(dictionary, position);
+                if (size > dictionary.size() - position)
+                    throw runtime_error("Invalid template dictionary in log archive.");
+                constants.push_back(dictionary.substr(position, size));
+                position += size;
+            }
+        }
+
+        string packedIds = ReadSection(archive, offset);
+        if (packedIds.size() <= sizeof(WideArchiveMagic) || packedIds.compare(0, sizeof(WideArchiveMagic), WideArchiveMagic, sizeof(WideArchiveMagic)) != 0
+            || static_cast<uint8_t>(packedIds[sizeof(WideArchiveMagic)]) != WideSymbolTraits<uint16_t>::Kind)
+            throw runtime_error("Invalid line IDs in log archive.");
+        lineIds = DecompressWide<uint16_t>(packedIds, sizeof(WideArchiveMagic) + 1);
+        if (lineIds.size() % 2 != 0)
+            throw runtime_error("Invalid line IDs in log archive.");
+        packedLiterals = ReadSection(archive, offset);
+        uint64_t streamCount = ReadVarint(archive, offset);
+        if (streamCount > MaxLogFieldStreams)
+            throw runtime_error("Invalid field stream count in log archive.");
+        packedFields.clear();
+        for (uint64_t stream = 0; stream < streamCount; stream++)
+            packedFields.push_back(ReadSection(archive, offset));
+    }
+
+    /// @brief Number of lines.
+    size_t LineCount() const { return lineIds.size() / 2; }
+
+    /// @brief Template ID of a line, checked against the dictionary.
+    size_t Id(size_t line) const
+    {
+        size_t id = static_cast<unsigned char>(lineIds[2 * line]) | (static_cast<unsigned char>(lineIds[2 * line + 1]) << 8);
+        if (id > templates.size())
+            throw runtime_error("Unknown template ID in log archive.");
+        return id;
+    }
+};
+
+/// @brief Takes the next newline-terminated value from a stream.
+string_view NextLogValue(const string& stream, size_t& cursor)
+{
+    size_t end = stream.find('\n', cursor);
+    if (end == string::npos)
+        throw runtime_error("Stream ends early in log archive.");
+    string_view value(stream.data() + cursor, end - cursor);
+    cursor = end + 1;
+    return value;
+}
+
+/// @brief Decompresses a log archive, filling every line's template with its fields.
+/// @param input The archive.
+/// @returns The restored log.
+string DecompressLogText(const string& input)
+{
+    LogArchive archive;
+    archive.Load(input);
+    vector<string> streams;
+    for (const string& packed : archive.packedFields)
+        streams.push_back(DecompressBlocks(packed));
+    vector<size_t> cursors(streams.size(), 0);
+    string literals = DecompressBlocks(archive.packedLiterals);
+    size_t literalCursor = 0;
+
+    string text;
+    for (size_t line = 0; line < archive.LineCount(); line++)
+    {
+        size_t id = archive.Id(line);
+        if (id == 0)
+            text += NextLogValue(literals, literalCursor);
+        else
+        {
+            const vector<string>& constants = archive.templates[id - 1];
+            text += constants[0];
+            for (size_t field = 1; field < constants.size(); field++)
+            {
+                size_t stream = LogFieldStream(field - 1);
+                if (stream >= streams.size())
+                    throw runtime_error("Missing field stream in log archive.");
+                text += NextLogValue(streams[stream], cursors[stream]);
+                text += constants[field];
+            }
+        }
+        text.push_back('\n');
+    }
+    if (text.size() == archive.rawSize + 1 && text.back() == '\n')
+        text.pop_back(); ///< The last line had no newline.
+    if (text.size() != archive.rawSize)
+        throw runtime_error("Size mismatch in log archive.");
+    return text;
+}
+
+/// @brief Decompresses a log archive file.
+/// @param inputFileName The archive.
+/// @param outputFileName The restored log.
+void DecompressLogs(const string& inputFileName, const string& outputFileName)
+{
+    string text = DecompressLogText(ReadFile(inputFileName));
+    ofstream outputFile(outputFileName, ios::binary);
+    outputFile.write(text.data(), text.size());
+    if (!outputFile)
+        throw runtime_error("Cannot write " + outputFileName);
+}
+
+/// @brief Searches one field of a log archive, decoding only the template dictionary, the IDs, that field's stream
+/// and, if there are any, the literal lines.
+/// @param inputFileName The archive.
+/// @param field Index of the field within its line, counted from 0.
+/// @param pattern Text the field value must contain.
+/// @returns Number of matches, every match is printed as "<line number>:<value>" (lines from 1).
+size_t GrepLogField(const string& inputFileName, size_t field, const string& pattern)
+{
+    LogArchive archive;
+    archive.Load(ReadFile(inputFileName));
+    size_t target = LogFieldStream(field), cursor = 0, literalCursor = 0, matches = 0;
+    bool hasLiterals = false;
+    for (size_t line = 0; line < archive.LineCount() && !hasLiterals; line++)
+        hasLiterals = archive.Id(line) == 0;
+    string stream = target < archive.packedFields.size() ? DecompressBlocks(archive.packedFields[target]) : string();
+    string literals = hasLiterals ? DecompressBlocks(archive.packedLiterals) : string(); ///< Rare lines are often the ones searched for.
+    vector<string_view> constants, fields;
+    for (size_t line = 0; line < archive.LineCount(); line++)
+    {
+        size_t id = archive.Id(line);
+        if (id == 0)
+        {
+            SplitLogLine(NextLogValue(literals, literalCursor), constants, fields); ///< Literal lines are split the way lc splits templated ones.
+            if (field < fields.size() && fields[field].find(pattern) != string_view::npos)
+            {
+                cout << line + 1 << ':' << fields[field] << '\n';
+                matches++;
+            }
+            continue;
+        }
+        size_t fieldCount = archive.templates[id - 1].size() - 1;
+        for (size_t other = target; other < fieldCount && LogFieldStream(other) == target; other++)
+        {
+            string_view value = NextLogValue(stream, cursor); ///< The last stream holds several fields per line.
+            if (other == field && value.find(pattern) != string_view::npos)
+            {
+                cout << line + 1 << ':' << value << '\n';
+                matches++;
+            }
+        }
+    }
+    return matches;
+}
+
+/// @struct ContextMemoryStats
+/// @brief Accounting kept by the allocator callbacks bench and compare hand to the codecs.
+struct ContextMemoryStats
+{
+    atomic<size_t> bytes{ 0 }; ///< Bytes currently allocated.
+    atomic<size_t> peakBytes{ 0 }; ///< Highest value of bytes.
+    atomic<size_t> allocations{ 0 }; ///< Number of allocate calls.
+};
+
+/// @brief Allocate callback of bench and compare, stands in for a caller's arena allocator.
+void* CountingAllocate(size_t size, size_t alignment, void* userData)
+{
+    ContextMemoryStats& stats = *static_cast<ContextMemoryStats*>(userData);
+    size_t current = stats.bytes += size;
+    size_t peak = stats.peakBytes.load();
+    while (current > peak && !stats.peakBytes.compare_exchange_weak(peak, current)) {} ///< Threaded compare runs share the stats.
+    stats.allocations++;
+    return aligned_alloc(alignment, (max<size_t>(size, 1) + alignment - 1) / alignment * alignment); ///< aligned_alloc wants a multiple of the alignment.
+}
+
+/// @brief Free callback of bench and compare.
+void CountingFree(void* pointer, size_t size, size_t, void* userData)
+{
+    static_cast<ContextMemoryStats*>(userData)->bytes -= size;
+    free(pointer);
+}
+
+/// @struct CompareStrategy
+/// @brief One configuration measured by the compare action.
+struct CompareStrategy
+{
+    string name; ///< Label printed in the report.
+    function<string(const string&)> compress; ///< Turns the input into an archive.
+    function<string(const string&)> decompress; ///< Restores the input from the archive.
+};
+
+/// @struct CompareResult
+/// @brief Measurements of one configuration.
+struct CompareResult
+{
+    double ratio = 0; ///< Input size divided by output size.
+    double encodeSpeed = 0; ///< Encode throughput in MB/s.
+    double decodeSpeed = 0; ///< Decode throughput in MB/s.
+    size_t peakMemory = 0; ///< Peak bytes the codec took from the default pmr memory resource.
+    bool roundTrip = false; ///< Whether the decoded data matched the input.
+};
+
+/// @brief Wraps block archive settings as a compare configuration.
+CompareStrategy BlockStrategy(const string& name, const BlockOptions& options)
+{
+    return { name, [options](const string& input) { return CompressBlocks(input, options); },
+        [options](const string& archive) { return DecompressBlocks(archive, options.threadCount); } };
+}
+
+/// @brief Lists the configurations compared by the compare action.
+///
+/// Block sizes with static and lag-one tables, the per-block options at the default block size,
+/// threaded coding, and the token, wide-symbol, column and log codecs.
+vector<CompareStrategy> CompareStrategies()
+{
+    vector<CompareStrategy> strategies;
+    for (size_t blockSize : { size_t(16) << 10, size_t(64) << 10, size_t(128) << 10, size_t(1) << 20, MaxBlockSize })
+    {
+        BlockOptions options;
+        options.blockSize = blockSize;
+        strategies.push_back(BlockStrategy("static/" + to_string(blockSize >> 10) + "K", options));
+        options.lagOne = true;
+        strategies.push_back(BlockStrategy("lag-one/" + to_string(blockSize >> 10) + "K", options));
+    }
+
+    BlockOptions options;
+    options.topK = AutoTopK;
+    strategies.push_back(BlockStrategy("top-k auto", options));
+    options = BlockOptions();
+    options.pairs = true;
+    strategies.push_back(BlockStrategy("pairs", options));
+    options = BlockOptions();
+    options.filter = AutoFilter;
+    strategies.push_back(BlockStrategy("filter auto", options));
+    options = BlockOptions();
+    options.planes = AutoPlanes;
+    strategies.push_back(BlockStrategy("planes auto", options));
+    options.topK = AutoTopK;
+    options.pairs = true;
+    options.filter = AutoFilter;
+    strategies.push_back(BlockStrategy("all auto", options));
+    unsigned threadCount = thread::hardware_concurrency();
+    if (threadCount > 1)
+    {
+        options = BlockOptions();
+        options.threadCount = threadCount;
+        strategies.push_back(BlockStrategy("threads " + to_string(threadCount), options));
+    }
+
+    strategies.push_back({ "tokens (tc)", [](const string& input) { ostream discard(nullptr); return CompressTokenText(input, "", discard); },
+        [](const string& archive) { return DecompressTokenText(archive, ""); } });
+    strategies.push_back({ "utf8 (wc)", [](const string& input) { return CompressWideText(input, WideSymbolTraits<char32_t>::Name); },
+        DecompressWideText });
+    strategies.push_back({ "u16 (wc)", [](const string& input) { return CompressWideText(input, WideSymbolTraits<uint16_t>::Name); },
+        DecompressWideText });
+    strategies.push_back({ "columns (csv)", [](const string& input) { ostream discard(nullptr); return CompressColumnText(input, 0, DefaultBlockSize, discard); },
+        DecompressColumnText });
+    strategies.push_back({ "logs (lc)", [](const string& input) { ostream discard(nullptr); return CompressLogText(input, discard); },
+        DecompressLogText });
+    return strategies;
+}
+
+/// @brief Runs a function repeatedly for at least 100 ms (and at least once) and returns the fastest run in seconds.
+template <typename Function>
+double MeasureFastest(Function function)
+{
+    double fastest = 1e300, total = 0;
+    for (int run = 0; run < 20 && (run == 0 || total < 0.1); run++)
+    {
+        auto start = chrono::steady_clock::now();
+        function();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        fastest = min(fastest, seconds);
+        total += seconds;
+    }
+    return max(fastest, 1e-9);
+}
+
+/// @brief Measures one configuration fully in memory.
+///
+/// One untimed round trip runs with a counting CallbackMemoryResource as the default memory
+/// resource, so the codecs' pmr containers report their peak; ordinary strings and vectors
+/// (archive, output, per-block buffers, dictionaries) are not counted. The timed runs use the normal heap.
+/// @param input The data to compress.
+/// @param strategy The configuration.
+/// @returns The measurements.
+CompareResult MeasureStrategy(const string& input, const CompareStrategy& strategy)
+{
+    CompareResult result;
+    string archive, decoded;
+    {
+        ContextMemoryStats memory;
+        CallbackMemoryResource resource(CountingAllocate, CountingFree, &memory);
+        pmr::memory_resource* previous = pmr::set_default_resource(&resource);
+        try
+        {
+            archive = strategy.compress(input);
+            decoded = strategy.decompress(archive);
+        }
+        catch (...)
+        {
+            pmr::set_default_resource(previous);
+            throw;
+        }
+        pmr::set_default_resource(previous);
+        result.peakMemory = memory.peakBytes;
+    }
+    result.roundTrip = decoded == input;
+    result.ratio = double(input.size()) / max<size_t>(archive.size(), 1);
+
+    double megabytes = input.size() / 1e6;
+    result.encodeSpeed = megabytes / MeasureFastest([&]() { archive = strategy.compress(input); });
+    result.decodeSpeed = megabytes / MeasureFastest([&]() { decoded = strategy.decompress(archive); });
+    return result;
+}
+
+/// @brief Runs every configuration on a file and prints the speed/ratio trade-offs.
+///
+/// A configuration is marked Pareto-optimal if no other one is at least as good in ratio,
+/// encode speed and decode speed and strictly better in one of them.
+/// @param inputFileName The name of the file to measure.
+void CompareStrategiesOnFile(const string& inputFileName)
+{
+    string input = ReadFile(inputFileName);
+    vector<CompareStrategy> strategies = CompareStrategies();
+    vector<CompareResult> results;
+    for (const CompareStrategy& strategy : strategies)
+    {
+        try
+        {
+            results.push_back(MeasureStrategy(input, strategy));
+        }
+        catch (const exception&)
+        {
+            results.emplace_back(); ///< A codec that rejects the input or runs out of memory shows as a failed round trip.
+        }
+    }
+
+    cout << "Input: " << inputFileName << " (" << input.size() << " bytes)\n";
+    cout << left << setw(20) << "strategy" << right << setw(9) << "ratio" << setw(12) << "enc MB/s" << setw(12) << "dec MB/s"
+        << setw(14) << "pmr peak MiB" << "  pareto\n";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const CompareResult& a = results[i];
+        bool dominated = false;
+        for (const CompareResult& b : results)
+            dominated = dominated || (b.roundTrip && b.ratio >= a.ratio && b.encodeSpeed >= a.encodeSpeed && b.decodeSpeed >= a.decodeSpeed
+                && (b.ratio > a.ratio || b.encodeSpeed > a.encodeSpeed || b.decodeSpeed > a.decodeSpeed));
+        cout << left << setw(20) << strategies[i].name << right << fixed << setprecision(3) << setw(9) << a.ratio
+            << setprecision(1) << setw(12) << a.encodeSpeed << setw(12) << a.decodeSpeed
+            << setprecision(2) << setw(14) << a.peakMemory / 1048576.0
+            << "  " << (a.roundTrip ? (dominated ? "" : "*") : "ROUND TRIP FAILED") << '\n';
+    }
+}
+
+/// @brief Lists the instruction set extensions the binary was compiled for and the host supports.
+/// @returns Two lines of text.
+string DescribeCpuFeatures()
+{
+    string compiled = "Compiled for:";
+#if defined(__x86_64__) || defined(__i386__)
+    compiled += " x86";
+#elif defined(__aarch64__)
+    compiled += " aarch64";
+#endif
+#ifdef __SSE2__
+    compiled += " sse2";
+#endif
+#ifdef __SSE4_2__
+    compiled += " sse4.2";
+#endif
+#ifdef __POPCNT__
+    compiled += " popcnt";
+#endif
+#ifdef __AVX2__
+    compiled += " avx2";
+#endif
+#ifdef __BMI2__
+    compiled += " bmi2";
+#endif
+#ifdef __ARM_NEON
+    compiled += " neon";
+#endif
+
+    string host = "Host supports:";
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) host += " sse2";
+    if (__builtin_cpu_supports("sse4.2")) host += " sse4.2";
+    if (__builtin_cpu_supports("popcnt")) host += " popcnt";
+    if (__builtin_cpu_supports("avx2")) host += " avx2";
+    if (__builtin_cpu_supports("bmi2")) host += " bmi2";
+    if (__builtin_cpu_supports("avx512f")) host += " avx512f";
+#else
+    host += " (not detected on this architecture)";
+#endif
+    return compiled + "\n" + host + "\n";
+}
+
+/// @brief Round-trips a file in memory several times and prints min/median throughput.
+///
+/// Single-threaded runs go through reused EncoderContext/DecoderContext objects, the way a
+/// long-running caller would, take their memory from allocator callbacks, and report the
+/// allocations of one warmed up round trip.
+/// @param inputFileName The name of the file to measure.
+/// @param iterations Number of encode and decode runs.
+/// @param options Archive settings.
+/// @returns True if every round trip reproduced the input.
+bool RunBenchmark(const string& inputFileName, int iterations, const BlockOptions& options)
+{
+    string input = ReadFile(inputFileName);
+    string archive, decoded;
+    vector<double> encodeSeconds, decodeSeconds;
+    ContextMemoryStats contextMemory;
+    CallbackMemoryResource contextResource(CountingAllocate, CountingFree, &contextMemory);
+    EncoderContext encoderContext(options, &contextResource);
+    DecoderContext decoderContext(&contextResource);
+    bool reuseContexts = options.threadCount == 1;
+    bool roundTrip = true;
+    for (int iteration = 0; iteration < iterations; iteration++)
+    {
+        auto start = chrono::steady_clock::now();
+        if (reuseContexts)
+            encoderContext.Compress(input.data(), input.size(), archive);
+        else
+            archive = CompressBlocks(input, options);
+        auto middle = chrono::steady_clock::now();
+        if (reuseContexts)
+            decoderContext.Decompress(archive, decoded);
+        else
+            decoded = DecompressBlocks(archive, options.threadCount);
+        auto end = chrono::steady_clock::now();
+        encodeSeconds.push_back(max(chrono::duration<double>(middle - start).count(), 1e-9));
+        decodeSeconds.push_back(max(chrono::duration<double>(end - middle).count(), 1e-9));
+        roundTrip = roundTrip && decoded == input; ///< Every iteration is verified, not only the first.
+    }
+    sort(encodeSeconds.begin(), encodeSeconds.end());
+    sort(decodeSeconds.begin(), decodeSeconds.end());
+
+    size_t steadyAllocations = 0;
+    if (reuseContexts)
+    {
+        size_t allocationsBefore = contextMemory.allocations; ///< The timed iterations warmed the contexts up.
+        encoderContext.Compress(input.data(), input.size(), archive);
+        decoderContext.Decompress(archive, decoded);
+        steadyAllocations = contextMemory.allocations - allocationsBefore;
+        roundTrip = roundTrip && decoded == input;
+    }
+
+    double megabytes = input.size() / 1e6;
+    cout << "File: " << inputFileName << " (" << input.size() << " bytes), " << iterations << " iterations\n";
+    cout << "Block size: " << options.blockSize << " bytes" << (options.lagOne ? ", lag-one tables" : ", static tables")
+        << ", " << options.threadCount << " thread(s)\n";
+    cout << DescribeCpuFeatures();
+    cout << fixed << setprecision(3) << "Compression ratio: " << double(input.size()) / archive.size() << '\n';
+    cout << setprecision(1);
+    cout << "Encode MB/s: min " << megabytes / encodeSeconds.back() << ", median " << megabytes / encodeSeconds[encodeSeconds.size() / 2]
+        << ", max " << megabytes / encodeSeconds.front() << '\n';
+    cout << "Decode MB/s: min " << megabytes / decodeSeconds.back() << ", median " << megabytes / decodeSeconds[decodeSeconds.size() / 2]
+        << ", max " << megabytes / decodeSeconds.front() << '\n';
+    if (reuseContexts)
+    {
+        cout << "Context memory (allocator callbacks): " << contextMemory.peakBytes << " bytes peak in " << contextMemory.allocations << " allocations\n";
+        cout << "Context allocations per warm round trip: " << steadyAllocations << '\n';
+    }
+    cout << "Round trip: " << (roundTrip ? "OK" : "FAILED") << endl;
+    return roundTrip;
+}
+
+/// @brief Calculates and displays the file size before and after compression.
+/// @param inputFileName The name of the input file.
+/// @param outputFileName The name of the output file.
+void FileSizeCompress(const string& inputFileName, const string& outputFileName) {
+    auto inputSize = fs::file_size(inputFileName); ///< Gets the size of the input file in bytes.
+    auto outputSize = fs::file_size(outputFileName); ///< Gets the size of the output file in bytes.
+
+    cout << "Compression completed!" << endl;
+
+    cout << "Original Size: " << inputSize << " bytes\n"; ///< Displays the original file size.
+    cout << "Compressed Size: " << outputSize << " bytes\n"; ///< Displays the compressed file size.
+
+    double compressionPercent = 100.0 * (1 - (double)outputSize / inputSize); ///< Calculates the compression percentage.
+    cout << "Compression Percentage: " << compressionPercent << "%\n"; ///< Displays the compression percentage.
+}
+
+/// @brief Calculates and displays the file size before and after decompression.
+/// @param inputFileName The name of the compressed input file.
+/// @param outputFileName The name of the decompressed output file.
+void FileSizeDecompress(const string& inputFileName, const string& outputFileName) {
+    auto inputSize = fs::file_size(inputFileName); ///< Gets the size of the compressed file in bytes.
+    auto outputSize = fs::file_size(outputFileName); ///< Gets the size of the decompressed file in bytes.
+
+    cout << "Decompression completed!" << endl;
+
+    cout << "Compressed Size: " << inputSize << " bytes\n"; ///< Displays the compressed file size.
+    cout << "Decompressed Size: " << outputSize << " bytes\n"; ///< Displays the decompressed file size.
+
+    double decompressionIncreasePercent = 100.0 * ((double)outputSize / inputSize - 1); ///< Calculates the decompression increase percentage.
+    cout << "Decompression Increase Percentage: " << decompressionIncreasePercent << "%\n"; ///< Displays the decompression increase percentage.
+}
+
+/// @brief Decodes the first bytes of a block that stores its own table.
+/// @param archive The archive.
+/// @param entry The block.
+/// @param limit Maximum number of bytes to decode.
+/// @returns The decoded bytes.
+string DecodeIndexedBlock(const string& archive, const BlockIndexEntry& entry, size_t limit)
+{
+    if (entry.header.mode == BlockMode::Raw)
+        return archive.substr(entry.payloadOffset, min<size_t>(limit, entry.header.rawSize));
+    if (entry.header.mode == BlockMode::Filtered || entry.header.mode == BlockMode::Planes)
+    {
+        string output;
+        BlockDecoder().DecodeBlock(entry.header, archive.data() + entry.payloadOffset, output); ///< Filters and planes need the whole block.
+        output.resize(min<size_t>(limit, output.size()));
+        return output;
+    }
+    HuffmanTable table;
+    HuffmanScratch scratch;
+    const char* payload = archive.data() + entry.payloadOffset;
+    size_t tableSize = ReadStoredTable(entry.header.mode, payload, entry.header.payloadSize, table, scratch);
+    BitReader reader(payload + tableSize, entry.header.payloadSize - tableSize);
+    string output(min<size_t>(limit, entry.header.rawSize), '\0');
+    pmr::vector<unsigned> histogram(BlockAlphabetSize, 0);
+    BlockDecoder::DecodeSymbols(reader, output.size(), BuildHuffmanDecoder(table), output.data(), histogram);
+    return output;
+}
+
+/// @brief Appends the offsets of all (possibly overlapping) occurrences of a pattern.
+/// @param text The text to search.
+/// @param pattern The pattern.
+/// @param base Offset added to every reported position.
+/// @param matches Receives the offsets.
+void FindAll(const string& text, const string& pattern, uint64_t base, vector<uint64_t>& matches)
+{
+    boyer_moore_horspool_searcher searcher(pattern.begin(), pattern.end());
+    for (auto it = text.begin(); ; it++)
+    {
+        it = search(it, text.end(), searcher);
+        if (it == text.end())
+            return;
+        matches.push_back(base + (it - text.begin()));
+    }
+}
+
+/// @brief Codes a pattern with a block table.
+/// @param pattern The pattern.
+/// @param table The block table.
+/// @param bits Receives the code bits, one per element.
+/// @returns False if a pattern byte cannot occur in the block.
+bool EncodePattern(const string& pattern, const HuffmanTable& table, vector<uint8_t>& bits)
+{
+    auto append = [&](uint64_t code, unsigned length) {
+        for (unsigned i = length; i-- > 0; )
+            bits.push_back((code >> i) & 1);
+    };
+    for (char ch : pattern)
+    {
+        unsigned char byte = static_cast<unsigned char>(ch);
+        if (table.codeLengths[byte] > 0)
+            append(table.codes[byte], table.codeLengths[byte]);
+        else if (table.codeLengths.size() > EscapeSymbol && table.codeLengths[EscapeSymbol] > 0)
+        {
+            append(table.codes[EscapeSymbol], table.codeLengths[EscapeSymbol]);
+            append(byte, 8);
+        }
+        else
+            return false;
+    }
+    return true;
+}
+
+/// @brief Checks whether a bit pattern occurs at any bit offset of a byte range.
+///
+/// For each of the 8 possible alignments the bytes fully covered by the pattern are searched
+/// with a byte searcher and only the partial bytes at both ends are compared bit by bit.
+/// @param data Start of the range.
+/// @param size Length of the range.
+/// @param bits The pattern, one bit per element.
+/// @returns True if the pattern occurs, or if it is too short to filter on.
+bool ContainsBitPattern(const unsigned char* data, size_t size, const vector<uint8_t>& bits)
+{
+    if (bits.size() < 15)
+        return true; ///< Too short to guarantee a whole byte at every alignment.
+
+    auto bitAt = [&](uint64_t position) { return (data[position / 8] >> (7 - position % 8)) & 1; };
+    uint64_t totalBits = uint64_t(size) * 8;
+    for (unsigned shift = 0; shift < 8; shift++)
+    {
+        size_t first = (8 - shift) % 8; ///< Pattern bit that starts the first whole byte.
+        size_t wholeBytes = (bits.size() - first) / 8;
+        string needle(wholeBytes, '\0');
+        for (size_t i = 0; i < wholeBytes * 8; i++)
+            needle[i / 8] |= static_cast<char>(bits[first + i] << (7 - i % 8));
+
+        boyer_moore_horspool_searcher searcher(needle.begin(), needle.end());
+        const char* begin = reinterpret_cast<const char*>(data);
+        const char* end = begin + size;
+        for (const char* it = begin; ; it++)
+        {
+            it = search(it, end, searcher);
+            if (it == end)
+                break;
+            uint64_t wholeStart = uint64_t(it - begin) * 8;
+            if (wholeStart < first || wholeStart - first + bits.size() > totalBits)
+                continue;
+            uint64_t start = wholeStart - first;
+            bool match = true;
+            for (size_t i = 0; i < first && match; i++)
+                match = bitAt(start + i) == bits[i];
+            for (size_t i = first + wholeBytes * 8; i < bits.size() && match; i++)
+                match = bitAt(start + i) == bits[i];
+            if (match)
+                return true;
+        }
+    }
+    return false;
+}
+
+/// @brief Searches one block that stores its own table.
+///
+/// The pattern is coded with the block's table and looked up in the compressed bits first.
+/// A miss proves the block cannot contain the pattern, a hit may be misaligned with the code
+/// boundaries, so the block is then decoded and searched directly.
+/// @param archive The archive.
+/// @param entry The block.
+/// @param pattern The pattern.
+/// @param matches Receives the offsets of matches that start and end inside the block.
+void GrepBlock(const string& archive, const BlockIndexEntry& entry, const string& pattern, vector<uint64_t>& matches)
+{
+    if (entry.header.mode != BlockMode::Huffman && entry.header.mode != BlockMode::PackedHuffman) ///< Only these code the bytes one by one in order.
+    {
+        FindAll(DecodeIndexedBlock(archive, entry, entry.header.rawSize), pattern, entry.rawOffset, matches);
+        return;
+    }
+    HuffmanTable table;
+    HuffmanScratch scratch;
+    const char* payload = archive.data() + entry.payloadOffset;
+    size_t tableSize = ReadStoredTable(entry.header.mode, payload, entry.header.payloadSize, table, scratch);
+    vector<uint8_t> bits;
+    if (!EncodePattern(pattern, table, bits))
+        return;
+    if (!ContainsBitPattern(reinterpret_cast<const unsigned char*>(payload + tableSize), entry.header.payloadSize - tableSize, bits))
+        return;
+    FindAll(DecodeIndexedBlock(archive, entry, entry.header.rawSize), pattern, entry.rawOffset, matches);
+}
+
+/// @brief Searches a block archive for a literal pattern.
+/// @param archive The archive.
+/// @param pattern The pattern, must not be empty.
+/// @param threadCount Number of worker threads.
+/// @returns Sorted offsets of all matches in the decoded data.
+vector<uint64_t> GrepBlocks(const string& archive, const string& pattern, unsigned threadCount)
+{
+    vector<BlockIndexEntry> index = ReadBlockIndex(archive);
+    vector<uint64_t> matches;
+
+    bool independent = true; ///< Every block stores its own table and is at least as long as the pattern overlap.
+    for (const BlockIndexEntry& entry : index)
+        independent = independent && DecodesIndependently(entry.header.mode) && entry.header.rawSize + 1 >= pattern.size();
+    if (!independent)
+    {
+        FindAll(DecompressBlocks(archive), pattern, 0, matches); ///< Lag-one blocks depend on each other, search the decoded data.
+        return matches;
+    }
+
+    vector<vector<uint64_t>> blockMatches(index.size());
+    ParallelFor(index.size(), threadCount, [&](size_t block) {
+        GrepBlock(archive, index[block], pattern, blockMatches[block]);
+    });
+
+    for (size_t block = 0; block + 1 < index.size() && pattern.size() > 1; block++) ///< Matches crossing a block boundary.
+    {
+        string head = DecodeIndexedBlock(archive, index[block + 1], pattern.size() - 1);
+        bool possible = false;
+        for (size_t k = 1; k < pattern.size() && !possible; k++)
+            possible = head.compare(0, pattern.size() - k, pattern, k, string::npos) == 0;
+        if (!possible)
+            continue; ///< Only the next block's first bytes were decoded.
+        string tail = DecodeIndexedBlock(archive, index[block], index[block].header.rawSize);
+        string window = tail.substr(tail.size() - (pattern.size() - 1)) + head;
+        vector<uint64_t> windowMatches;
+        FindAll(window, pattern, index[block + 1].rawOffset - (pattern.size() - 1), windowMatches);
+        blockMatches[block].insert(blockMatches[block].end(), windowMatches.begin(), windowMatches.end());
+    }
+
+    for (const vector<uint64_t>& found : blockMatches)
+        matches.insert(matches.end(), found.begin(), found.end());
+    sort(matches.begin(), matches.end());
+    return matches;
+}
+
+/// @brief Magic bytes at the start of a wavelet tree index file.
+const char WaveletIndexMagic[4] = { 'H', 'W', 'T', '1' };
+
+/// @struct RankBitVector
+/// @brief Bit vector with constant time rank and logarithmic time select.
+///
+/// A cumulative count of set bits is kept for every 512-bit superblock, which adds 12.5% to the raw bits.
+struct RankBitVector
+{
+    vector<uint64_t> words; ///< The bits, bit i is bit (i % 64) of word i / 64.
+    vector<uint64_t> superblockRanks; ///< Number of set bits before every 8-word superblock.
+    uint64_t size = 0; ///< Number of bits.
+
+    /// @brief Appends one bit.
+    void PushBack(bool bit)
+    {
+        if (size % 64 == 0)
+            words.push_back(0);
+        if (bit)
+            words.back() |= uint64_t(1) << (size % 64);
+        size++;
+    }
+
+    /// @brief Returns bit i.
+    bool Get(uint64_t i) const
+    {
+        return (words[i / 64] >> (i % 64)) & 1;
+    }
+
+    /// @brief Builds the rank directory, must be called after the last PushBack.
+    void BuildRankDirectory()
+    {
+        superblockRanks.assign(words.size() / 8 + 1, 0);
+        uint64_t ones = 0;
+        for (size_t word = 0; word < words.size(); word++)
+        {
+            if (word % 8 == 0)
+                superblockRanks[word / 8] = ones;
+            ones += __builtin_popcountll(words[word]);
+        }
+    }
+
+    /// @brief Number of set bits in [0, i).
+    uint64_t Rank1(uint64_t i) const
+    {
+        uint64_t word = i / 64;
+        uint64_t ones = superblockRanks[word / 8];
+        for (uint64_t w = word & ~uint64_t(7); w < word; w++)
+            ones += __builtin_popcountll(words[w]);
+        if (i % 64 != 0)
+            ones += __builtin_popcountll(words[word] & ((uint64_t(1) << (i % 64)) - 1));
+        return ones;
+    }
+
+    /// @brief Number of bits equal to `bit` in [0, i).
+    uint64_t Rank(bool bit, uint64_t i) const
+    {
+        return bit ? Rank1(i) : i - Rank1(i);
+    }
+
+    /// @brief Position of the k-th (1-based) bit equal to `bit`.
+    uint64_t Select(bool bit, uint64_t k) const
+    {
+        uint64_t low = 0, high = size; ///< Smallest i with Rank(bit, i + 1) >= k.
+        while (low < high)
+        {
+            uint64_t middle = low + (high - low) / 2;
+            if (Rank(bit, middle + 1) >= k)
+                high = middle;
+            else
+                low = middle + 1;
+        }
+        return low;
+    }
+};
+
+/// @struct WaveletNode
+/// @brief Node of a Huffman-shaped wavelet tree.
+struct WaveletNode
+{
+    RankBitVector bits; ///< Next code bit of every text symbol passing through this node.
+    int child[2] = { -1, -1 }; ///< Indices of the children for bit 0 and bit 1, -1 for leaves.
+    char character = 0; ///< Character of a leaf.
+};
+
+/// @struct WaveletTree
+/// @brief Huffman-shaped wavelet tree answering rank, select and access queries over the original text.
+///
+/// Every internal node corresponds to an internal node of the Huffman tree and stores one bit per
+/// text symbol below it, so the bit vectors hold exactly as many bits as the compressed data.
+struct WaveletTree
+{
+    vector<WaveletNode> nodes; ///< Nodes in preorder, the root is node 0.
+    unordered_map<char, string> codes; ///< Huffman code of every character.
+    uint64_t textLength = 0; ///< Number of characters in the indexed text.
+
+    /// @brief Creates the tree shape from Huffman codes.
+    explicit WaveletTree(const unordered_map<char, string>& huffmanCodes) : codes(huffmanCodes)
+    {
+        vector<pair<string, char>> sortedCodes;
+        for (const auto& pair : codes)
+            sortedCodes.emplace_back(pair.second, pair.first);
+        sort(sortedCodes.begin(), sortedCodes.end()); ///< Inserting codes in lexicographic order numbers the nodes in preorder.
+
+        nodes.emplace_back();
+        for (const auto& pair : sortedCodes)
+        {
+            int node = 0;
+            for (char bit : pair.first)
+            {
+                int& child = nodes[node].child[bit - '0'];
+                if (child < 0)
+                {
+                    child = static_cast<int>(nodes.size());
+                    nodes.emplace_back(); ///< May reallocate, the reference is not used afterwards.
+                }
+                node = nodes[node].child[bit - '0'];
+            }
+            nodes[node].character = pair.second;
+        }
+    }
+
+    /// @brief Whether a node is a leaf.
+    bool IsLeaf(int node) const
+    {
+        return nodes[node].child[0] < 0 && nodes[node].child[1] < 0;
+    }
+
+    /// @brief Fills the bit vectors from the text and builds their rank directories.
+    void Build(const string& text)
+    {
+        for (char ch : text)
+        {
+            auto code = codes.find(ch);
+            if (code == codes.end())
+                throw runtime_error("Character without Huffman code in indexed text.");
+            int node = 0;
+            for (char bit : code->second)
+            {
+                nodes[node].bits.PushBack(bit == '1'); ///< Routes the character one level down.
+                node = nodes[node].child[bit - '0'];
+            }
+        }
+        textLength = text.size();
+        for (WaveletNode& node : nodes)
+            node.bits.BuildRankDirectory();
+    }
+
+    /// @brief Number of occurrences of a character in [0, i).
+    uint64_t Rank(char ch, uint64_t i) const
+    {
+        auto code = codes.find(ch);
+        if (code == codes.end())
+            return 0;
+        int node = 0;
+        for (char bit : code->second)
+        {
+            i = nodes[node].bits.Rank(bit == '1', i);
+            node = nodes[node].child[bit - '0'];
+        }
+        return i;
+    }
+
+    /// @brief Number of occurrences of a character in the inclusive range [first, last].
+    uint64_t Count(char ch, uint64_t first, uint64_t last) const
+    {
+        last = min(last, textLength - 1);
+        if (textLength == 0 || first > last)
+            return 0;
+        return Rank(ch, last + 1) - Rank(ch, first);
+    }
+
+    /// @brief Character at position i of the text.
+    char Access(uint64_t i) const
+    {
+        int node = 0;
+        while (!IsLeaf(node))
+        {
+            bool bit = nodes[node].bits.Get(i);
+            i = nodes[node].bits.Rank(bit, i);
+            node = nodes[node].child[bit];
+        }
+        return nodes[node].character;
+    }
+
+    /// @brief Position of the k-th (1-based) occurrence of a character.
+    /// @returns The position, or textLength if there are fewer than k occurrences.
+    uint64_t Select(char ch, uint64_t k) const
+    {
+        auto code = codes.find(ch);
+        if (code == codes.end() || k == 0 || Rank(ch, textLength) < k)
+            return textLength;
+        vector<int> path;
+        int node = 0;
+        for (char bit : code->second)
+        {
+            path.push_back(node);
+            node = nodes[node].child[bit - '0'];
+        }
+        uint64_t position = k - 1; ///< Position among the symbols of the leaf, mapped up one level at a time.
+        for (size_t level = path.size(); level-- > 0; )
+            position = nodes[path[level]].bits.Select(code->second[level] == '1', position + 1);
+        return position;
+    }
+
+    /// @brief Writes the bit vectors of all internal nodes (preorder), packed back to back, to an index file.
+    ///
+    /// Only the text length is stored, the length of every other bit vector follows from its parent.
+    void Save(const string& indexFileName) const
+    {
+        string output(WaveletIndexMagic, sizeof(WaveletIndexMagic));
+        AppendUint64(output, textLength);
+        BitWriter writer(output);
+        for (const WaveletNode& node : nodes)
+            for (uint64_t i = 0; i < node.bits.size; i++)
+                writer.Write(node.bits.Get(i), 1);
+        writer.Flush();
+        ofstream indexFile(indexFileName, ios::binary);
+        indexFile.write(output.data(), output.size());
+    }
+
+    /// @brief Loads the bit vectors written by Save, the tree shape must come from the same codes.
+    void Load(const string& indexFileName)
+    {
+        string input = ReadFile(indexFileName);
+        if (input.compare(0, sizeof(WaveletIndexMagic), WaveletIndexMagic, sizeof(WaveletIndexMagic)) != 0)
+            throw runtime_error("Not a wavelet tree index: " + indexFileName);
+        size_t offset = sizeof(WaveletIndexMagic);
+        textLength = ReadUint64(input, offset);
+        BitReader reader(input.data() + offset, input.size() - offset);
+
+        vector<uint64_t> sizes(nodes.size(), 0);
+        sizes[0] = IsLeaf(0) ? 0 : textLength;
+        for (size_t index = 0; index < nodes.size(); index++) ///< Parents precede their children in preorder.
+        {
+            RankBitVector& bits = nodes[index].bits;
+            for (uint64_t i = 0; i < sizes[index]; i++)
+                bits.PushBack(reader.Read(1) != 0);
+            bits.BuildRankDirectory();
+            for (int bit = 0; bit < 2; bit++)
+                if (nodes[index].child[bit] >= 0 && !IsLeaf(nodes[index].child[bit]))
+                    sizes[nodes[index].child[bit]] = bits.Rank(bit, bits.size);
+        }
+    }
+};
+
+/// @brief Builds the wavelet tree index of a text from the Huffman tree used to compress it.
+/// @param root Root of the Huffman tree built by BuildHuffmanTree.
+/// @param text The compressed text.
+/// @param indexFileName The name of the index file to write.
+void BuildWaveletIndex(TreeNode* root, const string& text, const string& indexFileName)
+{
+    unordered_map<char, string> huffmanCodes;
+    GenerateHuffmanCodes(root, "", huffmanCodes); ///< The index follows the same code tree as the compressed data.
+    WaveletTree tree(huffmanCodes);
+    tree.Build(text);
+    tree.Save(indexFileName);
+}
+
+/// @brief Loads the wavelet tree index of a file compressed with the 'c' action.
+/// @param compressedFileName The name of the compressed file, its ".huff" and ".wt" files are read.
+/// @returns The loaded tree.
+WaveletTree LoadWaveletIndex(const string& compressedFileName)
+{
+    unordered_map<char, string> huffmanCodes;
+    for (const auto& pair : ReadHuffmanCodeFile(compressedFileName + ".huff"))
+        huffmanCodes[pair.second] = pair.first;
+    WaveletTree tree(huffmanCodes);
+    tree.Load(compressedFileName + ".wt");
+    return tree;
+}
+
+/// @brief Parses a character argument, "\n" stands for the newline character.
+char ParseCharacterArgument(const string& argument)
+{
+    if (argument == "\\n")
+        return '\n';
+    if (argument.size() != 1)
+        throw runtime_error("Expected a single character, got " + argument);
+    return argument[0];
+}
+
+/// @brief Parses a --filter value: auto, none, or delta, xor, zigzag or zigzag-delta with ":<width>".
+uint8_t ParseFilterArgument(const string& argument)
+{
+    if (argument == "auto")
+        return AutoFilter;
+    if (argument == "none")
+        return 0;
+    static const char* const names[] = { "delta", "xor", "zigzag", "zigzag-delta" };
+    size_t colon = argument.find(':');
+    for (unsigned kind = 1; kind <= 4 && colon != string::npos; kind++)
+        if (argument.compare(0, colon, names[kind - 1]) == 0)
+        {
+            uint8_t filter = MakeFilter(static_cast<FilterKind>(kind), static_cast<unsigned>(stoul(argument.substr(colon + 1))));
+            if (IsValidFilter(filter))
+                return filter;
+        }
+    throw runtime_error("Filter must be auto, none or delta|xor|zigzag|zigzag-delta:<1|2|4|8>.");
+}
+
+/// @brief Parses a --block-size value.
+/// @param value The argument.
+/// @returns The block size in bytes, between 1 and MaxBlockSize.
+size_t ParseBlockSize(const string& value)
+{
+    size_t blockSize = stoull(value);
+    if (blockSize == 0 || blockSize > MaxBlockSize)
+        throw runtime_error("Block size must be between 1 and " + to_string(MaxBlockSize) + " bytes.");
+    return blockSize;
+}
+
+/// @brief Parses the optional block archive settings following the positional arguments.
+/// @param argc Number of command line arguments.
+/// @param argv Array of command line arguments.
+/// @param first Index of the first option.
+/// @returns The parsed settings.
+BlockOptions ParseBlockOptions(int argc, char* argv[], int first)
+{
+    BlockOptions options;
+    for (int i = first; i < argc; i++)
+    {
+        string option = argv[i];
+        if (option == "--lag-one")
+            options.lagOne = true;
+        else if (option == "--lines")
+            options.lineIndex = true;
+        else if (option == "--pipeline")
+            options.pipeline = true;
+        else if (option == "--verify")
+            options.verify = true;
+        else if (option == "--no-prescreen")
+            options.prescreen = false;
+        else if (option == "--pairs")
+            options.pairs = true;
+        else if (option == "--filter" && i + 1 < argc)
+            options.filter = ParseFilterArgument(argv[++i]);
+        else if (option == "--planes" && i + 1 < argc)
+        {
+            string value = argv[++i];
+            options.planes = value == "auto" ? AutoPlanes : static_cast<unsigned>(stoul(value));
+            if (options.planes != AutoPlanes && options.planes > MaxPlanes)
+                throw runtime_error("Planes must be auto or between 0 and " + to_string(MaxPlanes) + ".");
+        }
+        else if (option == "--metrics" && i + 1 < argc)
+            options.metricsFileName = argv[++i];
+        else if (option == "--threads" && i + 1 < argc)
+            options.threadCount = max(1u, static_cast<unsigned>(stoul(argv[++i])));
+        else if (option == "--top-k" && i + 1 < argc)
+        {
+            string value = argv[++i];
+            options.topK = value == "auto" ? AutoTopK : static_cast<unsigned>(stoul(value));
+        }
+        else if (option == "--block-size" && i + 1 < argc)
+            options.blockSize = ParseBlockSize(argv[++i]);
+        else
+            throw runtime_error("Unknown option " + option);
+    }
+    return options;
+}
+
+/// @brief Whether an action only takes an input file.
+bool IsSingleFileAction(const string& action)
+{
+    return action == "lines" || action == "compare" || action == "bench";
+}
+
+/// @brief The main function handling command line arguments for compressing or decompressing files.
+/// @param argc Number of command line arguments.
+/// @param argv Array of command line arguments.
+/// @returns Returns 0 on successful execution, or 1 on error.
+int main(int argc, char* argv[]) {
+    if (argc < 3 || (argc < 4 && !IsSingleFileAction(argv[1]))) {
+        cerr << "Usage: " << argv[0] << " <action> <input file> <output file> [options]" << endl; ///< Checks for the correct number of arguments and displays usage instructions.
+        cerr << "Actions: c [--index], d (classic), bc, bd (block archive)" << endl;
+        cerr << "Benchmark: compare <file> measures every block configuration in memory" << endl;
+        cerr << "           bench <file> [--iterations N] [block options except --lines, --pipeline, --verify, --metrics] round-trips the file in memory" << endl;
+        cerr << "Search: grep <archive> <pattern> [--threads N] prints the byte offset of every match" << endl;
+        cerr << "Index queries: count <file> <char> <first> <last>, access <file> <position>, select <file> <char> <k>" << endl;
+        cerr << "Block options: --block-size <bytes>, --lag-one, --lines, --threads <count>, --pipeline, --verify, --top-k <K|auto>, --pairs, --filter <auto|kind:width>, --planes <K|auto>, --no-prescreen, --metrics <file>" << endl;
+        cerr << "Line queries: lines <archive>, line <archive> <number> (need --lines)" << endl;
+        cerr << "Batches: batch <directory> <archive> [--clusters N] [--metrics <file>], unbatch <archive> <directory> [--file <name>]" << endl;
+        cerr << "Wide symbols: wc <input> <output> [--symbols u8|u16|utf8], wd <archive> <output>" << endl;
+        cerr << "Tables: csv <input> <archive> [--delimiter <char|tab>] [--block-size <bytes>], uncsv <archive> <output>" << endl;
+        cerr << "Logs: lc, ld <input> <output> (templates and fields), lgrep <archive> <field> <pattern>" << endl;
+        cerr << "Tokens: tc, td <input> <output> [--dictionary <file>] (token alphabet), train <dictionary> <files...>" << endl;
+        return 1; ///< Exits with an error code if the number of arguments is incorrect.
+    }
+
+    string action = argv[1]; ///< Stores the action ('c' for compress, 'd' for decompress).
+    string inputFileName = argv[2]; ///< Stores the name of the input file.
+    string outputFileName = argc > 3 ? argv[3] : ""; ///< Stores the name of the output file.
+
+    try {
+        if (action == "c") {
+            string text = ReadFile(inputFileName); ///< Reads the input file.
+            priority_queue<TreeNode*, vector<TreeNode*>, CompareNodes> pq; ///< Creates a priority queue for building the Huffman tree.
+            BuildHuffmanTree(text, outputFileName, pq); ///< Builds the Huffman tree and encodes the file.
+            FileSizeCompress(inputFileName, outputFileName); ///< Displays the file size before and after compression.
+            if (argc > 4 && string(argv[4]) == "--index") {
+                BuildWaveletIndex(pq.top(), text, outputFileName + ".wt"); ///< Builds the rank/select index from the same tree.
+                cout << "Index Size: " << fs::file_size(outputFileName + ".wt") << " bytes\n";
+            }
+        }
+        else if (action == "d") {
+            DecodeFile(inputFileName, inputFileName + ".huff", outputFileName); ///< Decodes the file.
+            FileSizeDecompress(inputFileName, outputFileName); ///< Displays the file size before and after decompression.
+        }
+        else if (action == "bc") {
+            BlockOptions options = ParseBlockOptions(argc, argv, 4); ///< Reads the optional block settings.
+            CodecMetrics metrics;
+            if (!options.metricsFileName.empty())
+                options.metrics = &metrics;
+            CompressFileBlocks(inputFileName, outputFileName, options); ///< Encodes the file block by block.
+            if (options.metrics)
+                WriteMetricsFile(metrics, options.metricsFileName);
+            FileSizeCompress(inputFileName, outputFileName);
+            if (options.verify)
+                cout << "Verified: every block decodes to its input.\n";
+        }
+        else if (action == "grep") {
+            unsigned threadCount = max(1u, thread::hardware_concurrency());
+            if (argc == 6 && string(argv[4]) == "--threads")
+                threadCount = max(1u, static_cast<unsigned>(stoul(argv[5])));
+            else if (argc != 4)
+                throw runtime_error("Usage: grep <archive> <pattern> [--threads N]");
+            string pattern = argv[3];
+            if (pattern.empty())
+                throw runtime_error("Empty pattern.");
+            vector<uint64_t> matches = GrepBlocks(ReadFile(inputFileName), pattern, threadCount); ///< Searches the archive mostly without decoding it.
+            for (uint64_t offset : matches)
+                cout << offset << '\n';
+            return matches.empty() ? 1 : 0; ///< Same exit status as grep.
+        }
+        else if (action == "compare") {
+            CompareStrategiesOnFile(inputFileName); ///< Prints ratio, throughput and memory of every configuration.
+        }
+        else if (action == "bench") {
+            int iterations = 5;
+            vector<char*> blockArguments(argv, argv + 3); ///< Everything except --iterations goes to the block options.
+            for (int i = 3; i < argc; i++) {
+                string option = argv[i];
+                if (option == "--iterations" && i + 1 < argc)
+                    iterations = max(1, stoi(argv[++i]));
+                else if (option == "--pipeline" || option == "--verify" || option == "--lines" || option == "--metrics")
+                    throw runtime_error(option + " is not supported by bench, which codes in memory."); ///< Accepted by ParseBlockOptions but only file actions use it.
+                else
+                    blockArguments.push_back(argv[i]);
+            }
+            BlockOptions options = ParseBlockOptions(static_cast<int>(blockArguments.size()), blockArguments.data(), 3);
+            return RunBenchmark(inputFileName, iterations, options) ? 0 : 1;
+        }
+        else if (action == "lines") {
+            LineIndex index;
+            index.Load(inputFileName + ".lines", false); ///< Only the per-block counts are read.
+            cout << index.NewlineCount() << endl;
+        }
+        else if (action == "line") {
+            cout << ReadArchiveLine(inputFileName, stoull(argv[3])) << endl; ///< Decodes only the blocks holding the line.
+        }
+        else if (action == "count" && argc == 6) {
+            WaveletTree tree = LoadWaveletIndex(inputFileName); ///< Answers from the index, the data is not decompressed.
+            cout << tree.Count(ParseCharacterArgument(argv[3]), stoull(argv[4]), stoull(argv[5])) << endl;
+        }
+        else if (action == "access") {
+            WaveletTree tree = LoadWaveletIndex(inputFileName);
+            uint64_t position = stoull(argv[3]);
+            if (position >= tree.textLength)
+                throw runtime_error("Position is past the end of the text.");
+            char ch = tree.Access(position);
+            cout << (ch == '\n' ? string("\\n") : string(1, ch)) << endl;
+        }
+        else if (action == "select" && argc == 5) {
+            WaveletTree tree = LoadWaveletIndex(inputFileName);
+            uint64_t position = tree.Select(ParseCharacterArgument(argv[3]), stoull(argv[4]));
+            if (position == tree.textLength)
+                throw runtime_error("Fewer occurrences than requested.");
+            cout << position << endl;
+        }
+        else if (action == "batch") {
+            unsigned clusterCount = 0; ///< 0 picks the number of shared tables automatically.
+            string metricsFileName;
+            for (int i = 4; i < argc; i += 2)
+            {
+                string option = argv[i];
+                if (option == "--clusters" && i + 1 < argc)
+                    clusterCount = max(1u, static_cast<unsigned>(stoul(argv[i + 1])));
+                else if (option == "--metrics" && i + 1 < argc)
+                    metricsFileName = argv[i + 1];
+                else
+                    throw runtime_error("Usage: batch <directory> <archive> [--clusters N] [--metrics <file>]");
+            }
+            CodecMetrics metrics;
+            CompressBatch(inputFileName, outputFileName, clusterCount, metricsFileName.empty() ? nullptr : &metrics);
+            if (!metricsFileName.empty())
+                WriteMetricsFile(metrics, metricsFileName);
+            cout << "Compressed Size: " << fs::file_size(outputFileName) << " bytes\n";
+        }
+        else if (action == "unbatch") {
+            string onlyName;
+            if (argc == 6 && string(argv[4]) == "--file")
+                onlyName = argv[5];
+            else if (argc != 4)
+                throw runtime_error("Usage: unbatch <archive> <directory> [--file <name>]");
+            DecompressBatch(inputFileName, outputFileName, onlyName);
+        }
+        else if (action == "tc" || action == "td") {
+            string dictionaryFileName; ///< Empty: the archive carries its own dictionary.
+            if (argc == 6 && string(argv[4]) == "--dictionary")
+                dictionaryFileName = argv[5];
+            else if (argc != 4)
+                throw runtime_error("Usage: " + action + " <input> <output> [--dictionary <file>]");
+            if (action == "tc") {
+                CompressTokens(inputFileName, outputFileName, dictionaryFileName); ///< Codes whole words, numbers and blank runs as single symbols.
+                FileSizeCompress(inputFileName, outputFileName);
+            }
+            else {
+                DecompressTokens(inputFileName, outputFileName, dictionaryFileName);
+                FileSizeDecompress(inputFileName, outputFileName);
+            }
+        }
+        else if (action == "wc") {
+            string symbolType = WideSymbolTraits<char32_t>::Name;
+            if (argc == 6 && string(argv[4]) == "--symbols")
+                symbolType = argv[5];
+            else if (argc != 4)
+                throw runtime_error("Usage: wc <input> <output> [--symbols u8|u16|utf8]");
+            CompressWideFile(inputFileName, outputFileName, symbolType); ///< Codes 16-bit units or code points as single symbols.
+            FileSizeCompress(inputFileName, outputFileName);
+        }
+        else if (action == "wd") {
+            DecompressWideFile(inputFileName, outputFileName);
+            FileSizeDecompress(inputFileName, outputFileName);
+        }
+        else if (action == "csv") {
+            char delimiter = 0; ///< 0 detects the delimiter from the first line.
+            size_t blockSize = DefaultBlockSize;
+            for (int i = 4; i < argc; i += 2)
+            {
+                string option = argv[i];
+                if (option == "--delimiter" && i + 1 < argc)
+                    delimiter = string(argv[i + 1]) == "tab" ? '\t' : ParseCharacterArgument(argv[i + 1]);
+                else if (option == "--block-size" && i + 1 < argc)
+                    blockSize = ParseBlockSize(argv[i + 1]);
+                else
+                    throw runtime_error("Usage: csv <input> <archive> [--delimiter <char|tab>] [--block-size <bytes>]");
+            }
+            CompressColumns(inputFileName, outputFileName, delimiter, blockSize); ///< One table per column and row group.
+            FileSizeCompress(inputFileName, outputFileName);
+        }
+        else if (action == "uncsv") {
+            DecompressColumns(inputFileName, outputFileName);
+            FileSizeDecompress(inputFileName, outputFileName);
+        }
+        else if (action == "lc") {
+            CompressLogs(inputFileName, outputFileName); ///< Separates line templates from their variable fields.
+            FileSizeCompress(inputFileName, outputFileName);
+        }
+        else if (action == "ld") {
+            DecompressLogs(inputFileName, outputFileName);
+            FileSizeDecompress(inputFileName, outputFileName);
+        }
+        else if (action == "lgrep" && argc == 5) {
+            return GrepLogField(inputFileName, stoull(argv[3]), argv[4]) > 0 ? 0 : 1; ///< Same exit status as grep.
+        }
+        else if (action == "train") {
+            TrainTokenDictionary(vector<string>(argv + 3, argv + argc), inputFileName); ///< The dictionary comes first, then the samples.
+        }
+        else if (action == "bd") {
+            BlockOptions options = ParseBlockOptions(argc, argv, 4); ///< Only --threads applies to decoding.
+            DecompressFileBlocks(inputFileName, outputFileName, options.threadCount); ///< Decodes the archive block by block.
+            FileSizeDecompress(inputFileName, outputFileName);
+        }
+        else {
+            cerr << "Invalid action. Use 'c' or 'bc' for compress and 'd' or 'bd' for decompress." << endl; ///< Handles invalid actions.
+            return 1; ///< Exits with an error code for invalid actions.
+        }
     }
-    else {
-        cerr << "Invalid action. Use 'c' for compress and 'd' for decompress." << endl; ///< Handles invalid actions.
-        return 1; ///< Exits with an error code for invalid actions.
+    catch (const exception& error) {
+        cerr << "Error: " << error.what() << endl; ///< Reports malformed input or options.
+        return 1;
     }
 
     return 0; ///< Indicates successful execution.
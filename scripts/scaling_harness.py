@@ -0,0 +1,135 @@
+#!/usr/bin/env python3
+"""Throughput scaling harness for HuffmanCompressor.
+
+Sweeps thread counts and input sizes for compression and decompression,
+writes one CSV row per measurement and compares the results against a
+stored baseline JSON, flagging regressions above a threshold.
+
+In "memory" mode the numbers come from the `bench` action (in-memory round
+trips, median of several iterations). In "file" mode the `bc`/`bd` actions
+are timed as whole processes, which includes file I/O and keeps memory
+bounded for inputs larger than RAM.
+"""
+
+import argparse
+import csv
+import json
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+SIZE_SUFFIXES = {"K": 1 << 10, "M": 1 << 20, "G": 1 << 30}
+MEMORY_SIZES = "4K,64K,1M,16M,256M"  # bench keeps the input and both outputs in RAM
+FILE_SIZES = "4K,64K,1M,16M,256M,1G,4G,16G"
+
+
+def parse_size(text):
+    """Parses 4096, 4K, 16M or 16G (binary multiples)."""
+    if text[-1].upper() in SIZE_SUFFIXES:
+        return int(text[:-1]) * SIZE_SUFFIXES[text[-1].upper()]
+    return int(text)
+
+
+def measure_memory(binary, corpus, threads, iterations):
+    """Returns the median encode and decode MB/s reported by the bench action."""
+    output = subprocess.run(
+        [binary, "bench", corpus, "--iterations", str(iterations), "--threads", str(threads)],
+        check=True, capture_output=True, text=True).stdout
+    encode = re.search(r"Encode MB/s: .*median ([0-9.]+)", output)
+    decode = re.search(r"Decode MB/s: .*median ([0-9.]+)", output)
+    if "Round trip: OK" not in output or not encode or not decode:
+        raise RuntimeError("bench failed on %s:\n%s" % (corpus, output))
+    return float(encode.group(1)), float(decode.group(1))
+
+
+def measure_file(binary, corpus, threads, iterations, workdir):
+    """Returns the median encode and decode MB/s of whole bc/bd runs."""
+    archive = os.path.join(workdir, "archive.hfb")
+    restored = os.path.join(workdir, "restored.bin")
+    megabytes = os.path.getsize(corpus) / 1e6
+    encode_times, decode_times = [], []
+    for _ in range(iterations):
+        start = time.perf_counter()
+        subprocess.run([binary, "bc", corpus, archive, "--threads", str(threads)], check=True, capture_output=True)
+        middle = time.perf_counter()
+        subprocess.run([binary, "bd", archive, restored, "--threads", str(threads)], check=True, capture_output=True)
+        end = time.perf_counter()
+        encode_times.append(middle - start)
+        decode_times.append(end - middle)
+    if subprocess.run(["cmp", "-s", corpus, restored]).returncode != 0:
+        raise RuntimeError("round trip failed on %s" % corpus)
+    encode_times.sort()
+    decode_times.sort()
+    return megabytes / encode_times[len(encode_times) // 2], megabytes / decode_times[len(decode_times) // 2]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--binary", required=True, help="path to HuffmanCompressor")
+    parser.add_argument("--generator", required=True, help="path to CorpusGenerator")
+    parser.add_argument("--max-threads", type=int, default=os.cpu_count() or 1)
+    parser.add_argument("--sizes", default=None,
+                        help="comma separated input sizes (default %s in memory mode, %s in file mode)" % (MEMORY_SIZES, FILE_SIZES))
+    parser.add_argument("--distribution", default="english", help="CorpusGenerator distribution")
+    parser.add_argument("--mode", choices=["memory", "file"], default="memory")
+    parser.add_argument("--iterations", type=int, default=3)
+    parser.add_argument("--csv", default="scaling.csv", help="output CSV file")
+    parser.add_argument("--baseline", default=None, help="baseline JSON to compare against")
+    parser.add_argument("--write-baseline", action="store_true", help="store the results as the new baseline")
+    parser.add_argument("--threshold", type=float, default=0.10, help="allowed relative throughput drop")
+    args = parser.parse_args()
+    if args.sizes is None:
+        args.sizes = MEMORY_SIZES if args.mode == "memory" else FILE_SIZES
+    if args.baseline and not args.write_baseline and not os.path.exists(args.baseline):
+        print("Baseline %s does not exist, record one with --write-baseline" % args.baseline, file=sys.stderr)
+        return 2
+
+    thread_counts = sorted(set([1] + [t for t in (1, 2, 4, 8, 16, 32, 64, 128) if t <= args.max_threads] + [args.max_threads]))
+    results = {}
+    rows = []
+    with tempfile.TemporaryDirectory() as workdir:
+        for size_text in args.sizes.split(","):
+            size = parse_size(size_text)
+            corpus = os.path.join(workdir, "corpus.bin")
+            subprocess.run([args.generator, args.distribution, corpus, str(size)], check=True)
+            single = None
+            for threads in thread_counts:
+                if args.mode == "memory":
+                    encode, decode = measure_memory(args.binary, corpus, threads, args.iterations)
+                else:
+                    encode, decode = measure_file(args.binary, corpus, threads, args.iterations, workdir)
+                single = single or (encode, decode)
+                for operation, speed, base in (("compress", encode, single[0]), ("decompress", decode, single[1])):
+                    rows.append([size, threads, operation, "%.2f" % speed, "%.2f" % (speed / base)])
+                    results["%s:%d:%d:%s" % (args.mode, size, threads, operation)] = speed
+                print("size=%-12d threads=%-3d compress=%8.1f MB/s decompress=%8.1f MB/s" % (size, threads, encode, decode))
+
+    with open(args.csv, "w", newline="") as output:
+        writer = csv.writer(output)
+        writer.writerow(["size_bytes", "threads", "operation", "mb_per_s", "speedup_vs_1_thread"])
+        writer.writerows(rows)
+    print("Wrote %s" % args.csv)
+
+    regressions = []
+    if args.baseline and not args.write_baseline:
+        with open(args.baseline) as baseline_file:
+            baseline = json.load(baseline_file)
+        for key, speed in sorted(results.items()):
+            if key in baseline and speed < baseline[key] * (1 - args.threshold):
+                regressions.append("%s: %.1f MB/s vs baseline %.1f MB/s (%.0f%%)" % (
+                    key, speed, baseline[key], 100 * (speed / baseline[key] - 1)))
+        for line in regressions:
+            print("REGRESSION " + line)
+        print("%d regression(s) above %.0f%%" % (len(regressions), 100 * args.threshold))
+    if args.baseline and args.write_baseline:
+        with open(args.baseline, "w") as baseline_file:
+            json.dump(results, baseline_file, indent=2, sort_keys=True)
+        print("Wrote baseline %s" % args.baseline)
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())